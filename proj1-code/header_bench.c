@@ -0,0 +1,159 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "header_codec.h"
+
+// Number of headers encoded and decoded by default, as in a million-member archive
+#define DEFAULT_NUM_HEADERS 1000000
+// Headers handled per batch call; the batch arrays are allocated once up front
+#define BATCH_SIZE 4096
+
+// Returns the current time in seconds
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Fill 'fields' with the metadata of a made-up member number 'i', with
+// 'name' as storage for its name
+static void make_fields(header_fields_t *fields, char name[32], int i) {
+    snprintf(name, 32, "dir/file%07d.txt", i);
+    fields->name = name;
+    fields->uname = "user";
+    fields->gname = "group";
+    fields->mode = 0644;
+    fields->uid = 1000 + i % 7;
+    fields->gid = 100 + i % 3;
+    fields->size = (uint64_t) i * 37 % 100000;
+    fields->mtime = 1700000000 + i;
+    fields->devmajor = 8;
+    fields->devminor = 1;
+    fields->typeflag = '0';
+}
+
+// The header encoding used before header_codec.c: snprintf and strncpy per
+// field and a checksum summed over signed chars
+static void legacy_encode(tar_header *header, const header_fields_t *fields) {
+    memset(header, 0, sizeof(tar_header));
+    strncpy(header->name, fields->name, 100);
+    snprintf(header->mode, 8, "%07o", (unsigned) fields->mode);
+    snprintf(header->uid, 8, "%07o", (unsigned) fields->uid);
+    strncpy(header->uname, fields->uname, 32);
+    snprintf(header->gid, 8, "%07o", (unsigned) fields->gid);
+    strncpy(header->gname, fields->gname, 32);
+    snprintf(header->size, 12, "%011o", (unsigned) fields->size);
+    snprintf(header->mtime, 12, "%011o", (unsigned) fields->mtime);
+    header->typeflag = fields->typeflag;
+    strncpy(header->magic, "ustar", 6);
+    memcpy(header->version, "00", 2);
+    snprintf(header->devmajor, 8, "%07o", (unsigned) fields->devmajor);
+    snprintf(header->devminor, 8, "%07o", (unsigned) fields->devminor);
+    memset(header->chksum, ' ', 8);
+    unsigned sum = 0;
+    char *bytes = (char *) header;
+    for (int i = 0; i < sizeof(tar_header); i++) {
+        sum += bytes[i];
+    }
+    snprintf(header->chksum, 8, "%07o", sum);
+}
+
+// The header decoding used before header_codec.c: a copy of the header in a
+// malloc'd buffer and strtol per field, with no validation
+static int legacy_decode(const tar_header *header, header_fields_t *fields) {
+    tar_header *copy = malloc(sizeof(tar_header));
+    if (copy == NULL) {
+        return -1;
+    }
+    memcpy(copy, header, sizeof(tar_header));
+    fields->mode = strtol(copy->mode, NULL, 8);
+    fields->uid = strtol(copy->uid, NULL, 8);
+    fields->gid = strtol(copy->gid, NULL, 8);
+    fields->size = strtol(copy->size, NULL, 8);
+    fields->mtime = strtol(copy->mtime, NULL, 8);
+    fields->typeflag = copy->typeflag;
+    free(copy);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int num_headers = argc > 1 ? atoi(argv[1]) : DEFAULT_NUM_HEADERS;
+    if (num_headers <= 0) {
+        printf("Usage: %s [NUM_HEADERS]\n", argv[0]);
+        return 1;
+    }
+
+    header_fields_t *fields = malloc(BATCH_SIZE * sizeof(header_fields_t));
+    header_fields_t *decoded = malloc(BATCH_SIZE * sizeof(header_fields_t));
+    tar_header *headers = malloc(BATCH_SIZE * sizeof(tar_header));
+    char (*names)[32] = malloc(BATCH_SIZE * sizeof(*names));
+    if (fields == NULL || decoded == NULL || headers == NULL || names == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    for (int i = 0; i < BATCH_SIZE; i++) {
+        make_fields(&fields[i], names[i], i);
+    }
+
+    double legacy_encode_time = 0, legacy_decode_time = 0;
+    double codec_encode_time = 0, codec_decode_time = 0;
+    // folded into the output so the decoding cannot be optimized away
+    uint64_t legacy_total = 0, codec_total = 0;
+    for (int done = 0; done < num_headers; done += BATCH_SIZE) {
+        int n = num_headers - done < BATCH_SIZE ? num_headers - done : BATCH_SIZE;
+
+        double start = now();
+        for (int i = 0; i < n; i++) {
+            legacy_encode(&headers[i], &fields[i]);
+        }
+        legacy_encode_time += now() - start;
+
+        start = now();
+        for (int i = 0; i < n; i++) {
+            if (legacy_decode(&headers[i], &decoded[i]) != 0) {
+                perror("malloc");
+                return 1;
+            }
+            legacy_total += decoded[i].size;
+        }
+        legacy_decode_time += now() - start;
+
+        start = now();
+        if (header_encode_batch(headers, fields, n) != n) {
+            fprintf(stderr, "Failed to encode headers\n");
+            return 1;
+        }
+        codec_encode_time += now() - start;
+
+        start = now();
+        if (header_decode_batch(headers, decoded, n) != n) {
+            fprintf(stderr, "Failed to decode headers\n");
+            return 1;
+        }
+        for (int i = 0; i < n; i++) {
+            codec_total += decoded[i].size;
+        }
+        codec_decode_time += now() - start;
+    }
+    if (legacy_total != codec_total) {
+        fprintf(stderr, "Decoded sizes differ: %llu vs %llu\n",
+                (unsigned long long) legacy_total, (unsigned long long) codec_total);
+        return 1;
+    }
+
+    printf("%d headers\n", num_headers);
+    printf("%-24s %14s %14s\n", "", "encode (hdr/s)", "decode (hdr/s)");
+    printf("%-24s %14.0f %14.0f\n", "snprintf/strtol", num_headers / legacy_encode_time,
+           num_headers / legacy_decode_time);
+    printf("%-24s %14.0f %14.0f\n", "header_codec (batch)", num_headers / codec_encode_time,
+           num_headers / codec_decode_time);
+
+    free(fields);
+    free(decoded);
+    free(headers);
+    free(names);
+    return 0;
+}
@@ -0,0 +1,206 @@
+#include "header_codec.h"
+
+#include <string.h>
+
+// Marker bit of a field in the GNU base-256 encoding
+#define BASE256_FLAG 0x80
+// Sign bit of a base-256 value, within the first byte of its field
+#define BASE256_SIGN 0x40
+
+// Mask selecting every other byte of a 64-bit word
+#define BYTE_LANES 0x00ff00ff00ff00ffULL
+
+// Longest numeric field in a tar header (size and mtime)
+#define MAX_FIELD_WIDTH 12
+
+// Block-type flags for character and block special files
+#define CHRTYPE '3'
+#define BLKTYPE '4'
+
+int header_encode_number(char *field, size_t width, uint64_t value) {
+    // width - 1 octal digits, least significant first, then a null terminator
+    uint64_t rest = value;
+    for (size_t i = width - 1; i > 0; i--) {
+        field[i - 1] = '0' + (rest & 7);
+        rest >>= 3;
+    }
+    field[width - 1] = '\0';
+    if (rest == 0) {
+        return 0;
+    }
+
+    // too large for octal: the whole field after the marker byte is available
+    if (width - 1 < sizeof(uint64_t) && value >> (8 * (width - 1)) != 0) {
+        return -1;
+    }
+    rest = value;
+    for (size_t i = width - 1; i > 0; i--) {
+        field[i] = rest & 0xff;
+        rest >>= 8;
+    }
+    field[0] = (char) BASE256_FLAG;
+    return 0;
+}
+
+int header_decode_number(const char *field, size_t width, uint64_t *value) {
+    const unsigned char *bytes = (const unsigned char *) field;
+    if (width > MAX_FIELD_WIDTH) {
+        return -1;
+    }
+    if (bytes[0] & BASE256_FLAG) {
+        if (bytes[0] & BASE256_SIGN) {
+            return -1;
+        }
+        uint64_t result = bytes[0] & (BASE256_SIGN - 1);
+        for (size_t i = 1; i < width; i++) {
+            if (result >> 56 != 0) {
+                return -1;
+            }
+            result = result << 8 | bytes[i];
+        }
+        *value = result;
+        return 0;
+    }
+
+    size_t i = 0;
+    while (i < width && bytes[i] == ' ') {
+        i++;
+    }
+    size_t first_digit = i;
+    uint64_t result = 0;
+    // at most 12 digits, so 'result' cannot overflow
+    while (i < width && (unsigned) (bytes[i] - '0') < 8) {
+        result = result << 3 | (bytes[i] - '0');
+        i++;
+    }
+    if (i == first_digit) {
+        return -1;
+    }
+    while (i < width) {
+        if (bytes[i] != '\0' && bytes[i] != ' ') {
+            return -1;
+        }
+        i++;
+    }
+    *value = result;
+    return 0;
+}
+
+unsigned header_checksum(const tar_header *header) {
+    // sum eight bytes at a time, as four 16-bit lanes of byte pairs
+    const unsigned char *bytes = (const unsigned char *) header;
+    uint64_t lanes = 0;
+    for (size_t i = 0; i < sizeof(tar_header); i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        lanes += (word & BYTE_LANES) + (word >> 8 & BYTE_LANES);
+    }
+    // each lane holds at most 64 * 2 * 255, so none has overflowed into the next
+    unsigned sum =
+        (lanes & 0xffff) + (lanes >> 16 & 0xffff) + (lanes >> 32 & 0xffff) + (lanes >> 48);
+    // count the checksum field itself as blanks
+    for (size_t i = 0; i < sizeof(header->chksum); i++) {
+        sum += ' ' - (unsigned char) header->chksum[i];
+    }
+    return sum;
+}
+
+// Returns the checksum of 'header' summing its bytes as signed chars, as
+// some older tar programs (and earlier versions of minitar) did
+static int signed_checksum(const tar_header *header) {
+    const signed char *bytes = (const signed char *) header;
+    const size_t chksum_start = offsetof(tar_header, chksum);
+    const size_t chksum_end = chksum_start + sizeof(header->chksum);
+    int sum = ' ' * sizeof(header->chksum);
+    for (size_t i = 0; i < chksum_start; i++) {
+        sum += bytes[i];
+    }
+    for (size_t i = chksum_end; i < sizeof(tar_header); i++) {
+        sum += bytes[i];
+    }
+    return sum;
+}
+
+// Copy the string 'src' into the header field 'field' of 'width' bytes,
+// null-padded and only null-terminated if it is shorter than the field
+static void encode_string(char *field, size_t width, const char *src) {
+    if (src != NULL) {
+        memcpy(field, src, strnlen(src, width));
+    }
+}
+
+int header_encode(tar_header *header, const header_fields_t *fields) {
+    memset(header, 0, sizeof(tar_header));
+    encode_string(header->name, sizeof(header->name), fields->name);
+    encode_string(header->uname, sizeof(header->uname), fields->uname);
+    encode_string(header->gname, sizeof(header->gname), fields->gname);
+    // '|' rather than '||' so every field is written without branching
+    int error = header_encode_number(header->mode, sizeof(header->mode), fields->mode) |
+                header_encode_number(header->uid, sizeof(header->uid), fields->uid) |
+                header_encode_number(header->gid, sizeof(header->gid), fields->gid) |
+                header_encode_number(header->size, sizeof(header->size), fields->size) |
+                header_encode_number(header->mtime, sizeof(header->mtime), fields->mtime) |
+                header_encode_number(header->devmajor, sizeof(header->devmajor),
+                                     fields->devmajor) |
+                header_encode_number(header->devminor, sizeof(header->devminor),
+                                     fields->devminor);
+    header->typeflag = fields->typeflag;
+    memcpy(header->magic, "ustar", sizeof(header->magic));    // Includes the null terminator
+    memcpy(header->version, "00", sizeof(header->version));
+    // six digits, a null byte and a space, as POSIX specifies
+    header_encode_number(header->chksum, sizeof(header->chksum) - 1, header_checksum(header));
+    header->chksum[sizeof(header->chksum) - 1] = ' ';
+    return error == 0 ? 0 : -1;
+}
+
+// Returns 1 if 'header' carries the POSIX ustar or the GNU tar magic, or is an
+// old (V7) tar header with no magic at all, 0 otherwise
+static int has_tar_magic(const tar_header *header) {
+    static const char no_magic[8] = {0};
+    return (memcmp(header->magic, "ustar\0", 6) == 0 && memcmp(header->version, "00", 2) == 0) ||
+           (memcmp(header->magic, "ustar ", 6) == 0 && memcmp(header->version, " \0", 2) == 0) ||
+           (memcmp(header->magic, no_magic, 6) == 0 && memcmp(header->version, no_magic, 2) == 0);
+}
+
+int header_decode(const tar_header *header, header_fields_t *fields) {
+    uint64_t chksum;
+    if (!has_tar_magic(header) ||
+        header_decode_number(header->chksum, sizeof(header->chksum), &chksum) != 0 ||
+        (chksum != header_checksum(header) && chksum != (uint64_t) signed_checksum(header))) {
+        return -1;
+    }
+    int error = header_decode_number(header->mode, sizeof(header->mode), &fields->mode) |
+                header_decode_number(header->uid, sizeof(header->uid), &fields->uid) |
+                header_decode_number(header->gid, sizeof(header->gid), &fields->gid) |
+                header_decode_number(header->size, sizeof(header->size), &fields->size) |
+                header_decode_number(header->mtime, sizeof(header->mtime), &fields->mtime);
+    fields->typeflag = header->typeflag;
+    // device numbers are commonly left empty for anything but device files
+    fields->devmajor = 0;
+    fields->devminor = 0;
+    if (header->typeflag == CHRTYPE || header->typeflag == BLKTYPE) {
+        error |= header_decode_number(header->devmajor, sizeof(header->devmajor),
+                                      &fields->devmajor) |
+                 header_decode_number(header->devminor, sizeof(header->devminor),
+                                      &fields->devminor);
+    }
+    return error == 0 ? 0 : -1;
+}
+
+int header_encode_batch(tar_header *headers, const header_fields_t *fields, int n) {
+    for (int i = 0; i < n; i++) {
+        if (header_encode(&headers[i], &fields[i]) != 0) {
+            return i;
+        }
+    }
+    return n;
+}
+
+int header_decode_batch(const tar_header *headers, header_fields_t *fields, int n) {
+    for (int i = 0; i < n; i++) {
+        if (header_decode(&headers[i], &fields[i]) != 0) {
+            return i;
+        }
+    }
+    return n;
+}
@@ -0,0 +1,76 @@
+#ifndef _HEADER_CODEC_H
+#define _HEADER_CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "minitar.h"
+
+// Metadata of one archive member, as stored in its tar header
+typedef struct {
+    // Null-terminated names, only read when encoding; at most as many bytes as
+    // the header fields hold (100 for 'name', 32 for the others) are stored
+    const char *name;
+    const char *uname;
+    const char *gname;
+    uint64_t mode;
+    uint64_t uid;
+    uint64_t gid;
+    uint64_t size;
+    uint64_t mtime;
+    uint64_t devmajor;
+    uint64_t devminor;
+    char typeflag;
+} header_fields_t;
+
+/*
+ * Store 'value' in the numeric header field 'field' of 'width' bytes: as
+ * 0-padded octal followed by a null byte if it fits, and otherwise in the
+ * GNU base-256 encoding (high bit of the first byte set, then the value as a
+ * big-endian binary number), which other tar programs read as well.
+ * Returns 0 on success or -1 if 'value' does not fit even in base-256
+ */
+int header_encode_number(char *field, size_t width, uint64_t value);
+
+/*
+ * Read the numeric header field 'field' of 'width' bytes into 'value'.
+ * Octal fields may start with spaces and must hold at least one digit; the
+ * digits either fill the field or are followed only by null bytes and spaces.
+ * Negative base-256 values are rejected.
+ * Returns 0 on success or -1 if the field is malformed
+ */
+int header_decode_number(const char *field, size_t width, uint64_t *value);
+
+// Returns the checksum of 'header', computed as if its checksum field were all blanks
+unsigned header_checksum(const tar_header *header);
+
+/*
+ * Fill 'header' with the member metadata in 'fields', including the ustar
+ * magic and the checksum. No memory is allocated.
+ * Returns 0 on success or -1 if a value cannot be represented
+ */
+int header_encode(tar_header *header, const header_fields_t *fields);
+
+/*
+ * Check that 'header' is a well-formed ustar (or GNU or V7 tar) header with
+ * a correct checksum, and read its numeric fields and type into 'fields'.
+ * The name pointers in 'fields' are left untouched. No memory is allocated.
+ * Returns 0 on success or -1 if the header is invalid
+ */
+int header_decode(const tar_header *header, header_fields_t *fields);
+
+/*
+ * Encode 'n' headers from 'fields' into the preallocated array 'headers'.
+ * Returns the number of headers encoded, which is less than 'n' only if
+ * 'fields[result]' could not be encoded
+ */
+int header_encode_batch(tar_header *headers, const header_fields_t *fields, int n);
+
+/*
+ * Decode 'n' headers from 'headers' into the preallocated array 'fields'.
+ * Returns the number of headers decoded, which is less than 'n' only if
+ * 'headers[result]' is invalid
+ */
+int header_decode_batch(const tar_header *headers, header_fields_t *fields, int n);
+
+#endif    // _HEADER_CODEC_H
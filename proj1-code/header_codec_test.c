@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "header_codec.h"
+
+// Number of failed checks so far
+static int num_failures = 0;
+
+// Report whether the check described by 'description' passed
+static void check(int passed, const char *description) {
+    printf("%s: %s\n", passed ? "PASS" : "FAIL", description);
+    if (!passed) {
+        num_failures++;
+    }
+}
+
+// Fill 'fields' with the metadata of an ordinary small file named 'name'
+static void make_fields(header_fields_t *fields, const char *name) {
+    memset(fields, 0, sizeof(header_fields_t));
+    fields->name = name;
+    fields->uname = "user";
+    fields->gname = "group";
+    fields->mode = 0644;
+    fields->uid = 1000;
+    fields->gid = 100;
+    fields->size = 14;
+    fields->mtime = 1700000000;
+    fields->typeflag = '0';
+}
+
+// Store the checksum of 'header' summed over signed chars, as the baseline
+// version of minitar did, in its checksum field
+static void write_signed_checksum(tar_header *header) {
+    memset(header->chksum, ' ', sizeof(header->chksum));
+    unsigned sum = 0;
+    char *bytes = (char *) header;
+    for (int i = 0; i < sizeof(tar_header); i++) {
+        sum += bytes[i];
+    }
+    snprintf(header->chksum, sizeof(header->chksum), "%07o", sum);
+}
+
+int main(void) {
+    tar_header header;
+    header_fields_t fields;
+    header_fields_t decoded;
+    uint64_t value;
+
+    // values too large for octal round-trip through base-256
+    make_fields(&fields, "large.bin");
+    fields.size = 9ULL << 30;
+    fields.uid = 3000000;
+    int encoded = header_encode(&header, &fields) == 0;
+    check(encoded && (header.size[0] & 0x80) && (header.uid[0] & 0x80),
+          "size of 9 GiB and uid above 2^21 are encoded in base-256");
+    check(encoded && header_decode(&header, &decoded) == 0 && decoded.size == fields.size &&
+              decoded.uid == fields.uid && decoded.gid == fields.gid,
+          "base-256 size and uid decode to the original values");
+    check(header_encode_number(header.uid, sizeof(header.uid), 1ULL << 56) == -1,
+          "value too large for base-256 in an 8-byte field is refused");
+
+    // negative base-256 values are rejected
+    const char negative[12] = {(char) 0xff, (char) 0xff, (char) 0xff, (char) 0xff,
+                               (char) 0xff, (char) 0xff, (char) 0xff, (char) 0xff,
+                               (char) 0xff, (char) 0xff, (char) 0xff, (char) 0xfe};
+    check(header_decode_number(negative, sizeof(negative), &value) == -1,
+          "negative base-256 value is rejected");
+
+    // malformed octal fields are rejected
+    const char empty[8] = {0};
+    check(header_decode_number(empty, sizeof(empty), &value) == -1,
+          "field of null bytes is rejected");
+    check(header_decode_number("       ", 8, &value) == -1, "field of spaces is rejected");
+    check(header_decode_number("0000644x", 8, &value) == -1,
+          "field with a garbage terminator is rejected");
+    check(header_decode_number("00006x4", 8, &value) == -1,
+          "field with garbage after its digits is rejected");
+    check(header_decode_number(" 000644 ", 8, &value) == 0 && value == 0644,
+          "field padded with spaces is accepted");
+    check(header_decode_number("00000000644", 12, &value) == 0 && value == 0644,
+          "null-terminated field is accepted");
+
+    // checksums
+    make_fields(&fields, "hello.txt");
+    header_encode(&header, &fields);
+    header.mode[0] = '1';
+    check(header_decode(&header, &decoded) == -1, "header with a wrong checksum is rejected");
+
+    // a name with bytes above 127 gives different signed and unsigned sums
+    make_fields(&fields, "caf\xc3\xa9.txt");
+    header_encode(&header, &fields);
+    write_signed_checksum(&header);
+    check(header_decode_number(header.chksum, sizeof(header.chksum), &value) == 0 &&
+              value != header_checksum(&header),
+          "baseline header has a signed checksum");
+    check(header_decode(&header, &decoded) == 0 && decoded.size == fields.size,
+          "baseline header with a signed checksum is accepted");
+
+    // headers of old tar programs have no magic
+    make_fields(&fields, "old.txt");
+    header_encode(&header, &fields);
+    memset(header.magic, 0, sizeof(header.magic) + sizeof(header.version));
+    memset(header.uname, 0, sizeof(header.uname) + sizeof(header.gname));
+    header_encode_number(header.chksum, sizeof(header.chksum) - 1, header_checksum(&header));
+    header.chksum[sizeof(header.chksum) - 1] = ' ';
+    check(header_decode(&header, &decoded) == 0 && decoded.mode == 0644,
+          "V7 header without magic is accepted");
+    memcpy(header.magic, "ustaX", 6);
+    header_encode_number(header.chksum, sizeof(header.chksum) - 1, header_checksum(&header));
+    check(header_decode(&header, &decoded) == -1, "header with unknown magic is rejected");
+
+    return num_failures == 0 ? 0 : 1;
+}
@@ -1,43 +1,148 @@
+#define _GNU_SOURCE
 #include "minitar.h"
+#include "header_codec.h"
+#include "snapshot.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <grp.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #define NUM_TRAILING_BLOCKS 2
 #define MAX_MSG_LEN 128
 #define BLOCK_SIZE 512
-
-// Constants for tar compatibility information
-#define MAGIC "ustar"
+// Size of the buffers used when streaming member contents
+#define CHUNK_SIZE (128 * 1024)
+// Length of the name field of a tar header
+#define HEADER_NAME_LEN 100
+// Upper bound on the number of worker threads used by verify
+#define MAX_VERIFY_THREADS 16
+// Size of the scratch buffer for user and group name lookups
+#define LOOKUP_BUF_SIZE 16384
+// Number of user and group names remembered by the name caches
+#define NAME_CACHE_SIZE 64
+// Buffer size for a user or group name; header fields hold up to 32 bytes
+#define MAX_ID_NAME_LEN 33
+// Most symbolic links followed to find the file an archive name refers to
+#define MAX_SYMLINKS 40
+// Times a reader re-reads an invalid header, which may be torn by a concurrent
+// publish, and the pause before each attempt
+#define TORN_READ_RETRIES 3
+#define TORN_READ_DELAY_US 1000
+// First line of a sharded archive's manifest file
+#define MANIFEST_MAGIC "minitar-manifest 1"
 
 // Constants to represent different file types
 // We'll only use regular files in this project
 #define REGTYPE '0'
 #define DIRTYPE '5'
+// Vendor-specific type marking a file deleted since the previous incremental
+// backup; other tar programs treat it as an empty regular file
+#define DELTYPE 'R'
+
+// Recently looked up user or group name, to avoid repeated queries of the
+// system user and group databases, which can be slow (e.g. over the network)
+typedef struct {
+    unsigned id;
+    char name[MAX_ID_NAME_LEN];
+} cached_name_t;
+
+typedef struct {
+    cached_name_t entries[NAME_CACHE_SIZE];
+    int size;
+    // Entry to replace next once the cache is full
+    int next_victim;
+} name_cache_t;
+
+static name_cache_t user_names;
+static name_cache_t group_names;
+// Headers may be filled from several threads at once (e.g. for sharded archives)
+static pthread_mutex_t name_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Copy the cached name for 'id' into 'name'
+// Returns 0 if it was found or -1 if 'id' is not in the cache
+static int name_cache_find(name_cache_t *cache, unsigned id, char *name) {
+    int result = -1;
+    pthread_mutex_lock(&name_cache_lock);
+    for (int i = 0; i < cache->size; i++) {
+        if (cache->entries[i].id == id) {
+            strncpy(name, cache->entries[i].name, MAX_ID_NAME_LEN);
+            result = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&name_cache_lock);
+    return result;
+}
+
+static void name_cache_add(name_cache_t *cache, unsigned id, const char *name) {
+    pthread_mutex_lock(&name_cache_lock);
+    int slot = cache->size;
+    if (cache->size < NAME_CACHE_SIZE) {
+        cache->size++;
+    } else {
+        slot = cache->next_victim;
+        cache->next_victim = (cache->next_victim + 1) % NAME_CACHE_SIZE;
+    }
+    cache->entries[slot].id = id;
+    strncpy(cache->entries[slot].name, name, MAX_ID_NAME_LEN - 1);
+    cache->entries[slot].name[MAX_ID_NAME_LEN - 1] = '\0';
+    pthread_mutex_unlock(&name_cache_lock);
+}
 
 /*
- * Helper function to compute the checksum of a tar header block
- * Performs a simple sum over all bytes in the header in accordance with POSIX
- * standard for tar file structure.
+ * Look up the name of the user with ID 'uid' and store it in 'name'.
+ * Uses the reentrant getpwuid_r() so it is safe to call from several threads.
+ * Returns 0 on success or -1 if an error occurs
  */
-void compute_checksum(tar_header *header) {
-    // Have to initially set header's checksum to "all blanks"
-    memset(header->chksum, ' ', 8);
-    unsigned sum = 0;
-    char *bytes = (char *) header;
-    for (int i = 0; i < sizeof(tar_header); i++) {
-        sum += bytes[i];
+static int lookup_user_name(uid_t uid, char name[MAX_ID_NAME_LEN]) {
+    if (name_cache_find(&user_names, uid, name) == 0) {
+        return 0;
+    }
+    struct passwd pwd_buf;
+    struct passwd *pwd = NULL;
+    char lookup_buf[LOOKUP_BUF_SIZE];
+    getpwuid_r(uid, &pwd_buf, lookup_buf, sizeof(lookup_buf), &pwd);
+    if (pwd == NULL) {
+        return -1;
+    }
+    name_cache_add(&user_names, uid, pwd->pw_name);
+    return name_cache_find(&user_names, uid, name);
+}
+
+// Same as lookup_user_name(), but for the group with ID 'gid'
+static int lookup_group_name(gid_t gid, char name[MAX_ID_NAME_LEN]) {
+    if (name_cache_find(&group_names, gid, name) == 0) {
+        return 0;
     }
-    snprintf(header->chksum, 8, "%07o", sum);
+    struct group grp_buf;
+    struct group *grp = NULL;
+    char lookup_buf[LOOKUP_BUF_SIZE];
+    getgrgid_r(gid, &grp_buf, lookup_buf, sizeof(lookup_buf), &grp);
+    if (grp == NULL) {
+        return -1;
+    }
+    name_cache_add(&group_names, gid, grp->gr_name);
+    return name_cache_find(&group_names, gid, name);
+}
+
+void prime_name_cache(uid_t uid, gid_t gid) {
+    char name[MAX_ID_NAME_LEN];
+    lookup_user_name(uid, name);
+    lookup_group_name(gid, name);
 }
 
 /*
@@ -46,7 +151,6 @@ void compute_checksum(tar_header *header) {
  * Returns 0 on success or -1 if an error occurs
  */
 int fill_tar_header(tar_header *header, const char *file_name) {
-    memset(header, 0, sizeof(tar_header));
     char err_msg[MAX_MSG_LEN];
     struct stat stat_buf;
     // stat is a system call to inspect file metadata
@@ -56,41 +160,39 @@ int fill_tar_header(tar_header *header, const char *file_name) {
         return -1;
     }
 
-    strncpy(header->name, file_name, 100);    // Name of the file, null-terminated string
-    snprintf(header->mode, 8, "%07o",
-             stat_buf.st_mode & 07777);    // Permissions for file, 0-padded octal
-
-    snprintf(header->uid, 8, "%07o", stat_buf.st_uid);    // Owner ID of the file, 0-padded octal
-    struct passwd *pwd = getpwuid(stat_buf.st_uid);       // Look up name corresponding to owner ID
-    if (pwd == NULL) {
+    char uname[MAX_ID_NAME_LEN];
+    char gname[MAX_ID_NAME_LEN];
+    // Look up names corresponding to owner and group IDs
+    if (lookup_user_name(stat_buf.st_uid, uname) != 0) {
         snprintf(err_msg, MAX_MSG_LEN, "Failed to look up owner name of file %s", file_name);
         perror(err_msg);
         return -1;
     }
-    strncpy(header->uname, pwd->pw_name, 32);    // Owner name of the file, null-terminated string
-
-    snprintf(header->gid, 8, "%07o", stat_buf.st_gid);    // Group ID of the file, 0-padded octal
-    struct group *grp = getgrgid(stat_buf.st_gid);        // Look up name corresponding to group ID
-    if (grp == NULL) {
+    if (lookup_group_name(stat_buf.st_gid, gname) != 0) {
         snprintf(err_msg, MAX_MSG_LEN, "Failed to look up group name of file %s", file_name);
         perror(err_msg);
         return -1;
     }
-    strncpy(header->gname, grp->gr_name, 32);    // Group name of the file, null-terminated string
-
-    snprintf(header->size, 12, "%011o",
-             (unsigned) stat_buf.st_size);    // File size, 0-padded octal
-    snprintf(header->mtime, 12, "%011o",
-             (unsigned) stat_buf.st_mtime);    // Modification time, 0-padded octal
-    header->typeflag = REGTYPE;                // File type, always regular file in this project
-    strncpy(header->magic, MAGIC, 6);          // Special, standardized sequence of bytes
-    memcpy(header->version, "00", 2);          // A bit weird, sidesteps null termination
-    snprintf(header->devmajor, 8, "%07o",
-             major(stat_buf.st_dev));    // Major device number, 0-padded octal
-    snprintf(header->devminor, 8, "%07o",
-             minor(stat_buf.st_dev));    // Minor device number, 0-padded octal
 
-    compute_checksum(header);
+    header_fields_t fields;
+    fields.name = file_name;                   // Name of the file
+    fields.uname = uname;                      // Owner name of the file
+    fields.gname = gname;                      // Group name of the file
+    fields.mode = stat_buf.st_mode & 07777;    // Permissions for file
+    fields.uid = stat_buf.st_uid;              // Owner ID of the file
+    fields.gid = stat_buf.st_gid;              // Group ID of the file
+    fields.size = stat_buf.st_size;            // File size
+    fields.mtime = stat_buf.st_mtime < 0 ? 0 : stat_buf.st_mtime;    // Modification time
+    fields.devmajor = major(stat_buf.st_dev);                        // Major device number
+    fields.devminor = minor(stat_buf.st_dev);                        // Minor device number
+    fields.typeflag = REGTYPE;    // File type, always regular file in this project
+    if (header_encode(header, &fields) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Metadata of file %s too large for a tar header",
+                 file_name);
+        errno = EOVERFLOW;
+        perror(err_msg);
+        return -1;
+    }
     return 0;
 }
 
@@ -140,15 +242,352 @@ void write_tar_footer(FILE *archive) {
     fwrite(zero_block, 1, BLOCK_SIZE, archive);
 }
 
-int create_archive(const char *archive_name, const file_list_t *files) {
+void archive_index_init(archive_index_t *index) {
+    index->members = NULL;
+    index->size = 0;
+    index->capacity = 0;
+    index->end = 0;
+}
+
+void archive_index_clear(archive_index_t *index) {
+    free(index->members);
+    archive_index_init(index);
+}
+
+// Add a copy of 'header' at byte offset 'offset', describing a member of
+// 'size' bytes, to the tail of 'index'
+// Returns 0 on success or -1 if an error occurs
+static int archive_index_add(archive_index_t *index, const tar_header *header, off_t offset,
+                             size_t size) {
+    if (index->size == index->capacity) {
+        int new_capacity = index->capacity == 0 ? 64 : index->capacity * 2;
+        archive_member_t *members =
+            realloc(index->members, new_capacity * sizeof(archive_member_t));
+        if (members == NULL) {
+            return -1;
+        }
+        index->members = members;
+        index->capacity = new_capacity;
+    }
+    archive_member_t *member = &index->members[index->size++];
+    memcpy(&member->header, header, sizeof(tar_header));
+    member->offset = offset;
+    member->size = size;
+    return 0;
+}
+
+// Returns the offset just past the member whose header is at 'offset' and whose
+// contents, rounded up to a whole block, take 'size' bytes, or -1 if the member
+// runs past 'file_size'
+static off_t member_end_within(off_t offset, uint64_t size, off_t file_size) {
+    if (size > (uint64_t) file_size) {
+        return -1;
+    }
+    off_t member_end = offset + BLOCK_SIZE + (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    return member_end <= file_size ? member_end : -1;
+}
+
+/*
+ * Add each member found between 'index->end' and the end-of-archive marker of
+ * the archive open as 'fd' to 'index', leaving 'index->end' at the marker.
+ * Unless 'strict' is set, an invalid header may have been torn by a concurrent
+ * publish and is re-read a few times. Writers set 'strict': they hold the
+ * archive lock, so no publish can be in progress. If 'max_members' is
+ * positive, the scan stops after adding that many members.
+ * Returns 0 on success, 1 if the scan stopped before the end-of-archive marker,
+ * or -1 if an error occurs, with errno set to EINVAL if the archive is damaged
+ * or truncated
+ */
+static int scan_archive(int fd, archive_index_t *index, int strict, int max_members) {
+    struct stat stat_buf;
+    if (fstat(fd, &stat_buf) != 0) {
+        return -1;
+    }
+    tar_header header;
+    off_t offset = index->end;
+    for (int added = 0; max_members <= 0 || added < max_members; added++) {
+        ssize_t bytes_read = pread(fd, &header, sizeof(tar_header), offset);
+        if (bytes_read != sizeof(tar_header)) {
+            errno = EINVAL;
+            return -1;
+        }
+        // a zero block marks the end of the archive
+        if (is_all_zeros((const char *) &header)) {
+            return 0;
+        }
+        header_fields_t fields;
+        int valid = header_decode(&header, &fields) == 0;
+        // a torn read of a header being published is whole a moment later
+        for (int retry = 0; !valid && !strict && retry < TORN_READ_RETRIES; retry++) {
+            usleep(TORN_READ_DELAY_US);
+            valid = pread(fd, &header, sizeof(tar_header), offset) == sizeof(tar_header) &&
+                    header_decode(&header, &fields) == 0;
+        }
+        if (!valid) {
+            errno = EINVAL;
+            return -1;
+        }
+        // headers are only published after the member contents, so a member
+        // running past the end of the file, even as of a fresh fstat in case it
+        // was published since the one above, means the archive is truncated
+        off_t member_end = member_end_within(offset, fields.size, stat_buf.st_size);
+        if (member_end == -1 &&
+            (fstat(fd, &stat_buf) != 0 ||
+             (member_end = member_end_within(offset, fields.size, stat_buf.st_size)) == -1)) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (archive_index_add(index, &header, offset, fields.size) != 0) {
+            return -1;
+        }
+        offset = member_end;
+        index->end = offset;
+    }
+    return 1;
+}
+
+// Index handed over by archive_index_preload(), along with the version of the
+// archive it describes
+static archive_index_t preloaded_index;
+static struct stat preloaded_stat;
+static int have_preloaded_index = 0;
+
+// Returns 1 if 'a' and 'b' describe the same, unmodified version of a file
+static int same_file_version(const struct stat *a, const struct stat *b) {
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec &&
+           a->st_ctim.tv_sec == b->st_ctim.tv_sec && a->st_ctim.tv_nsec == b->st_ctim.tv_nsec;
+}
+
+void archive_index_preload(archive_index_t *index, const struct stat *stat_buf) {
+    if (have_preloaded_index) {
+        archive_index_clear(&preloaded_index);
+    }
+    preloaded_index = *index;
+    preloaded_stat = *stat_buf;
+    have_preloaded_index = 1;
+    archive_index_init(index);
+}
+
+/*
+ * Fill the empty 'index' with the members of the archive 'archive_name', open
+ * as 'fd', scanning strictly if 'strict' is set (see scan_archive()). A
+ * matching preloaded index is used instead of scanning if there is one; for a
+ * strict scan, only if it ends at an end-of-archive marker, as the preloaded
+ * index may have been built while a publish was in progress.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int load_index_from_fd(int fd, const char *archive_name, archive_index_t *index,
+                              int strict) {
     char err_msg[MAX_MSG_LEN];
-    FILE *minitar = fopen(archive_name, "w");
-    // error check file creation of the archive
-    if (minitar == NULL) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to open file for writing %s\n", archive_name);
+    struct stat stat_buf;
+    if (have_preloaded_index && fstat(fd, &stat_buf) == 0 &&
+        same_file_version(&stat_buf, &preloaded_stat)) {
+        char block[BLOCK_SIZE];
+        have_preloaded_index = 0;
+        if (!strict || (pread(fd, block, BLOCK_SIZE, preloaded_index.end) == BLOCK_SIZE &&
+                        is_all_zeros(block))) {
+            *index = preloaded_index;
+            return 0;
+        }
+        archive_index_clear(&preloaded_index);
+    }
+    if (scan_archive(fd, index, strict, 0) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to read header from archive %s", archive_name);
+        perror(err_msg);
+        archive_index_clear(index);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Open the archive 'archive_name' for reading. Readers take no lock: writers
+ * only ever publish complete members (see publish_members()), and a new
+ * archive replaces an old one by rename, so a reader always sees a consistent
+ * archive, possibly without the members of an append still in progress.
+ * Returns the new file descriptor or -1 if an error occurs
+ */
+static int open_archive(const char *archive_name) {
+    char err_msg[MAX_MSG_LEN];
+    int fd = open(archive_name, O_RDONLY);
+    if (fd == -1) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to open archive %s", archive_name);
         perror(err_msg);
+    }
+    return fd;
+}
+
+/*
+ * Open the existing archive 'archive_name' for reading and writing and take
+ * an exclusive flock(2) on it, so concurrent writers (e.g. from the server)
+ * take turns. If the archive was replaced by create_archive() while waiting
+ * for the lock, the new archive is opened and locked instead.
+ * Returns the new file descriptor or -1 if an error occurs
+ */
+static int open_locked_archive(const char *archive_name) {
+    char err_msg[MAX_MSG_LEN];
+    while (1) {
+        int fd = open(archive_name, O_RDWR);
+        if (fd == -1) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to open archive %s", archive_name);
+            perror(err_msg);
+            return -1;
+        }
+        if (flock(fd, LOCK_EX) != 0) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to lock archive %s", archive_name);
+            perror(err_msg);
+            close(fd);
+            return -1;
+        }
+        struct stat locked;
+        struct stat current;
+        if (fstat(fd, &locked) == 0 && stat(archive_name, &current) == 0 &&
+            (locked.st_dev != current.st_dev || locked.st_ino != current.st_ino)) {
+            close(fd);
+            continue;
+        }
+        return fd;
+    }
+}
+
+/*
+ * Make the members written to the archive open as 'fd' visible to readers.
+ * Every block of the new members except their first header, 'first_header',
+ * must already have been written after the end-of-archive marker at 'end',
+ * along with a new footer. These are synced to disk, then 'first_header' is
+ * written over the marker in a single block write and synced in turn. Until
+ * then readers (and the archive after a crash) end at the marker as before.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int publish_members(int fd, const tar_header *first_header, off_t end) {
+    if (fdatasync(fd) != 0 ||
+        pwrite(fd, first_header, sizeof(tar_header), end) != sizeof(tar_header) ||
+        fdatasync(fd) != 0) {
+        perror("Failed to publish new archive members");
+        return -1;
+    }
+    return 0;
+}
+
+int archive_index_load(const char *archive_name, archive_index_t *index) {
+    int fd = open_archive(archive_name);
+    if (fd == -1) {
+        return -1;
+    }
+    int result = load_index_from_fd(fd, archive_name, index, 0);
+    close(fd);
+    return result;
+}
+
+// Returns 1 if the header at byte offset 'offset' in 'fd' is identical to 'header'
+static int header_unchanged(int fd, const tar_header *header, off_t offset) {
+    tar_header on_disk;
+    return pread(fd, &on_disk, sizeof(tar_header), offset) == sizeof(tar_header) &&
+           memcmp(&on_disk, header, sizeof(tar_header)) == 0;
+}
+
+int archive_index_refresh(int fd, archive_index_t *index, int max_members) {
+    // members are only ever added past the old end-of-archive marker, so if the
+    // first and last known members are intact only the new tail needs scanning
+    if (index->size > 0 &&
+        (!header_unchanged(fd, &index->members[0].header, index->members[0].offset) ||
+         !header_unchanged(fd, &index->members[index->size - 1].header,
+                           index->members[index->size - 1].offset))) {
+        archive_index_clear(index);
+    }
+    int result = scan_archive(fd, index, 0, max_members);
+    if (result == -1) {
+        archive_index_clear(index);
+    }
+    return result;
+}
+
+// Copy a header's name field, which need not be null-terminated, into 'dest'
+static void copy_member_name(char dest[HEADER_NAME_LEN + 1], const tar_header *header) {
+    memcpy(dest, header->name, HEADER_NAME_LEN);
+    dest[HEADER_NAME_LEN] = '\0';
+}
+
+// A member's name and position in its archive, sorted to find later versions
+typedef struct {
+    // Header name field, which need not be null-terminated
+    const char *name;
+    int position;
+} member_name_t;
+
+// Compare function for sorting members by name, then by position
+static int compare_member_names(const void *a, const void *b) {
+    const member_name_t *x = a;
+    const member_name_t *y = b;
+    int cmp = strncmp(x->name, y->name, HEADER_NAME_LEN);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return x->position - y->position;
+}
+
+/*
+ * Sets superseded[i] to 1 for each member of 'index' that has a later member
+ * of the same name in the archive, and 0 otherwise.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int mark_superseded_members(const archive_index_t *index, char *superseded) {
+    // the names travel with the positions, so concurrent calls share no state
+    member_name_t *order = malloc(index->size * sizeof(member_name_t) + 1);
+    if (order == NULL) {
         return -1;
     }
+    for (int i = 0; i < index->size; i++) {
+        order[i].name = index->members[i].header.name;
+        order[i].position = i;
+    }
+    qsort(order, index->size, sizeof(member_name_t), compare_member_names);
+    for (int i = 0; i < index->size; i++) {
+        int next = i + 1;
+        superseded[order[i].position] =
+            next < index->size && strncmp(order[i].name, order[next].name, HEADER_NAME_LEN) == 0;
+    }
+    free(order);
+    return 0;
+}
+
+// Add the name of each member of 'index' to 'files', in archive order,
+// leaving out records of deleted files
+// Returns 0 on success or -1 if an error occurs
+static int index_file_list(const archive_index_t *index, file_list_t *files) {
+    for (int i = 0; i < index->size; i++) {
+        if (index->members[i].header.typeflag == DELTYPE) {
+            continue;
+        }
+        char name[HEADER_NAME_LEN + 1];
+        copy_member_name(name, &index->members[i].header);
+        if (file_list_add(files, name) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Populates 'header' with a record of the deletion of the file 'file_name'
+static void fill_deletion_header(tar_header *header, const char *file_name) {
+    header_fields_t fields;
+    memset(&fields, 0, sizeof(fields));    // Nothing follows the header
+    fields.name = file_name;
+    fields.mtime = time(NULL);    // When the deletion was seen
+    fields.typeflag = DELTYPE;
+    header_encode(header, &fields);
+}
+
+/*
+ * Write an archive of all files in 'files' to the new, empty stream 'minitar',
+ * which is to become the archive 'archive_name', followed by a deletion
+ * record for each file in 'deleted' unless it is NULL.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int write_archive(FILE *minitar, const char *archive_name, const file_list_t *files,
+                         const file_list_t *deleted) {
+    char err_msg[MAX_MSG_LEN];
     node_t *curr_file = files->head;
     // malloc space for the headers of the files to be archived
     tar_header *curr_header = malloc(sizeof(tar_header));
@@ -157,7 +596,6 @@ int create_archive(const char *archive_name, const file_list_t *files) {
         int tar_error = fill_tar_header(curr_header, curr_file->name);
         if (tar_error != 0) {
             free(curr_header);
-            fclose(minitar);
             snprintf(err_msg, MAX_MSG_LEN, "Failed to create minitar header for %s\n",
                      curr_file->name);
             perror(err_msg);
@@ -168,7 +606,6 @@ int create_archive(const char *archive_name, const file_list_t *files) {
         // should only write 1 element
         if (header_bytes_written != 1) {
             free(curr_header);
-            fclose(minitar);
             snprintf(err_msg, MAX_MSG_LEN, "Failed to write minitar header for %s\n",
                      curr_file->name);
             perror(err_msg);
@@ -178,7 +615,6 @@ int create_archive(const char *archive_name, const file_list_t *files) {
         FILE *fp_curr = fopen(curr_file->name, "r");
         if (fp_curr == NULL) {
             free(curr_header);
-            fclose(minitar);
             snprintf(err_msg, MAX_MSG_LEN, "Failed to open file for reading: %s\n",
                      curr_file->name);
             perror(err_msg);
@@ -194,7 +630,6 @@ int create_archive(const char *archive_name, const file_list_t *files) {
             bytes_written = fwrite(stored_data, 1, bytes_read, minitar);
             if (bytes_written != bytes_read) {
                 free(curr_header);
-                fclose(minitar);
                 fclose(fp_curr);
                 snprintf(err_msg, MAX_MSG_LEN,
                          "Bytes lost while reading from %s and writing to %s\n", curr_file->name,
@@ -211,43 +646,197 @@ int create_archive(const char *archive_name, const file_list_t *files) {
         fclose(fp_curr);
         curr_file = curr_file->next;
     }
+    // deleted files are recorded after the files that are still present
+    curr_file = deleted == NULL ? NULL : deleted->head;
+    while (curr_file != NULL) {
+        fill_deletion_header(curr_header, curr_file->name);
+        if (fwrite(curr_header, sizeof(tar_header), 1, minitar) != 1) {
+            free(curr_header);
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to write deletion record for %s",
+                     curr_file->name);
+            perror(err_msg);
+            return -1;
+        }
+        curr_file = curr_file->next;
+    }
     // fill two blocks of 0's to indicate the end of the minitar
     char zeros[BLOCK_SIZE * 2] = {0};
     size_t bytes_written_zeros = fwrite(zeros, 1, sizeof(zeros), minitar);
     if (bytes_written_zeros != sizeof(zeros)) {
         free(curr_header);
-        fclose(minitar);
         return -1;
     }
     free(curr_header);
-    fclose(minitar);
     return 0;
 }
 
+/*
+ * Follow the symbolic links from 'archive_name', as opening it for writing
+ * would, to the file they finally name, which need not exist yet, storing its
+ * path in 'resolved'.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int resolve_archive_name(const char *archive_name, char resolved[PATH_MAX]) {
+    if (strlen(archive_name) >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(resolved, archive_name);
+    for (int i = 0; i < MAX_SYMLINKS; i++) {
+        char target[PATH_MAX];
+        ssize_t len = readlink(resolved, target, sizeof(target) - 1);
+        if (len == -1) {
+            // not a link, or nothing there yet: this is the file to write
+            return errno == EINVAL || errno == ENOENT ? 0 : -1;
+        }
+        target[len] = '\0';
+        // a relative target is relative to the directory holding the link
+        char *slash = strrchr(resolved, '/');
+        if (target[0] != '/' && slash != NULL) {
+            if ((slash - resolved) + 1 + len >= PATH_MAX) {
+                errno = ENAMETOOLONG;
+                return -1;
+            }
+            strcpy(slash + 1, target);
+        } else {
+            strcpy(resolved, target);
+        }
+    }
+    errno = ELOOP;
+    return -1;
+}
+
+/*
+ * Create a new, empty file next to 'archive_name' to build a replacement for
+ * it in, storing its name in 'tmp_name'. The file gets the mode and owner of
+ * the existing archive if there is one, and otherwise the mode a new file
+ * would get from fopen(), that is 0666 less the umask.
+ * Returns the new file descriptor or -1 if an error occurs
+ */
+static int create_temp_archive(const char *archive_name, char tmp_name[PATH_MAX]) {
+    // distinguishes temporary files of concurrent creates in this process
+    static unsigned tmp_counter = 0;
+    int fd = -1;
+    while (fd == -1) {
+        unsigned n = __atomic_fetch_add(&tmp_counter, 1, __ATOMIC_RELAXED);
+        if (snprintf(tmp_name, PATH_MAX, "%s.tmp.%d.%u", archive_name, (int) getpid(), n) >=
+            PATH_MAX) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        // the kernel applies the umask to the mode, as for fopen()
+        fd = open(tmp_name, O_WRONLY | O_CREAT | O_EXCL, 0666);
+        if (fd == -1 && errno != EEXIST) {
+            return -1;
+        }
+    }
+    struct stat old_stat;
+    if (stat(archive_name, &old_stat) == 0) {
+        // changing the owner needs privileges, so keep going without them,
+        // just as rewriting the archive in place would have
+        if (fchown(fd, old_stat.st_uid, old_stat.st_gid) != 0 && errno != EPERM) {
+            close(fd);
+            unlink(tmp_name);
+            return -1;
+        }
+        if (fchmod(fd, old_stat.st_mode & 07777) != 0) {
+            close(fd);
+            unlink(tmp_name);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+/*
+ * Create the archive 'archive_name' holding the files in 'files', followed by
+ * a deletion record for each file in 'deleted' unless it is NULL.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int create_archive_with_deletions(const char *archive_name, const file_list_t *files,
+                                         const file_list_t *deleted) {
+    char err_msg[MAX_MSG_LEN];
+    // build the archive under a temporary name and rename it into place, so
+    // lock-free readers of an existing archive never see it half rewritten;
+    // a symbolic link is written through, so the rename goes onto its target
+    char target_name[PATH_MAX];
+    char tmp_name[PATH_MAX];
+    int fd = -1;
+    if (resolve_archive_name(archive_name, target_name) == 0) {
+        fd = create_temp_archive(target_name, tmp_name);
+    }
+    FILE *minitar = NULL;
+    if (fd != -1 && (minitar = fdopen(fd, "w")) == NULL) {
+        close(fd);
+        unlink(tmp_name);
+    }
+    // error check file creation of the archive
+    if (minitar == NULL) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to open file for writing %s\n", archive_name);
+        perror(err_msg);
+        return -1;
+    }
+    int result = write_archive(minitar, archive_name, files, deleted);
+    if (fflush(minitar) != 0 || fdatasync(fd) != 0) {
+        result = -1;
+    }
+    if (fclose(minitar) != 0) {
+        result = -1;
+    }
+    if (result == 0) {
+        // wait for writers of the archive being replaced to finish, as their
+        // changes will be lost; those waiting after us move to the new archive
+        int old_fd = open(target_name, O_RDONLY);
+        if (old_fd != -1) {
+            flock(old_fd, LOCK_EX);
+        }
+        if (rename(tmp_name, target_name) != 0) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to replace archive %s", archive_name);
+            perror(err_msg);
+            result = -1;
+        }
+        if (old_fd != -1) {
+            close(old_fd);
+        }
+    }
+    if (result != 0) {
+        unlink(tmp_name);
+    }
+    return result;
+}
+
+int create_archive(const char *archive_name, const file_list_t *files) {
+    return create_archive_with_deletions(archive_name, files, NULL);
+}
+
 int append_files_to_archive(const char *archive_name, const file_list_t *files) {
     char err_msg[MAX_MSG_LEN];
     // open the archive in read + write mode and error check
-    FILE *minitar = fopen(archive_name, "r+");
+    int fd = open_locked_archive(archive_name);
+    FILE *minitar = fd == -1 ? NULL : fdopen(fd, "r+");
     if (minitar == NULL) {
+        if (fd != -1) {
+            close(fd);
+        }
         snprintf(err_msg, MAX_MSG_LEN, "Failed to open archive for appending: %s\n", archive_name);
         perror(err_msg);
         return -1;
     }
-    // seek to the end of the archive minus the last two 0 header blocks
-    tar_header header;
-    while (fread(&header, sizeof(header), 1, minitar) == 1) {
-        if (header.name[0] == '\0') {    // found the end header
-            fseek(minitar, -sizeof(header), SEEK_CUR);
-            break;
-        }
-        // skipping the actual file contents
-        int file_size = strtol(header.size, NULL, 8);
-        int blocks = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-        fseek(minitar, blocks * BLOCK_SIZE, SEEK_CUR);
+    // new members go after the old end-of-archive marker, which stays in place
+    // until they are published, skipping the block of the first new header
+    archive_index_t index;
+    archive_index_init(&index);
+    if (load_index_from_fd(fd, archive_name, &index, 1) != 0) {
+        fclose(minitar);
+        return -1;
     }
+    off_t old_end = index.end;
+    fseek(minitar, old_end + BLOCK_SIZE, SEEK_SET);
+    archive_index_clear(&index);
     // get the first file node from the argument list
     node_t *curr_file = files->head;
     tar_header *curr_header = malloc(sizeof(tar_header));
+    tar_header first_header;
     while (curr_file != NULL) {
         // fill the tar header and error check
         int tar_error = fill_tar_header(curr_header, curr_file->name);
@@ -258,8 +847,10 @@ int append_files_to_archive(const char *archive_name, const file_list_t *files)
             perror(err_msg);
             return -1;
         }
-        // write the file header and error check
-        if (fwrite(curr_header, sizeof(tar_header), 1, minitar) != 1) {
+        // write the file header and error check; the first is written last
+        if (curr_file == files->head) {
+            memcpy(&first_header, curr_header, sizeof(tar_header));
+        } else if (fwrite(curr_header, sizeof(tar_header), 1, minitar) != 1) {
             free(curr_header);
             fclose(minitar);
             snprintf(err_msg, MAX_MSG_LEN, "Failed to write header for %s\n", curr_file->name);
@@ -299,36 +890,56 @@ int append_files_to_archive(const char *archive_name, const file_list_t *files)
     }
     // fill two blocks of 0's as footer
     char zeros[BLOCK_SIZE * 2] = {0};
-    fwrite(zeros, 1, sizeof(zeros), minitar);
+    int result = 0;
+    if (fwrite(zeros, 1, sizeof(zeros), minitar) != sizeof(zeros) || fflush(minitar) != 0 ||
+        (files->head != NULL && publish_members(fd, &first_header, old_end) != 0)) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to append to archive %s", archive_name);
+        perror(err_msg);
+        result = -1;
+    }
     free(curr_header);
     fclose(minitar);
-    return 0;
+    return result;
 }
 
 int update_archive(const char *archive_name, file_list_t *files) {
     char err_msg[MAX_MSG_LEN];
-    FILE *archive = fopen(archive_name, "r+");
+    int fd = open_locked_archive(archive_name);
+    FILE *archive = fd == -1 ? NULL : fdopen(fd, "r+");
     if (!archive) {
+        if (fd != -1) {
+            close(fd);
+        }
         perror("Error: Could not open archive for updating.");
         return -1;
     }
     // get list of files currently in the archive
+    // (read through the locked descriptor, so the index is of the archive being written)
+    archive_index_t index;
+    archive_index_init(&index);
     file_list_t archive_files;
     file_list_init(&archive_files);
-    if (get_archive_file_list(archive_name, &archive_files) == -1) {
+    if (load_index_from_fd(fd, archive_name, &index, 1) == -1 ||
+        index_file_list(&index, &archive_files) == -1) {
         perror("Error: Failed to get archive file list.");
+        archive_index_clear(&index);
+        file_list_clear(&archive_files);
         fclose(archive);
         return -1;
     }
     // checks all specified files making sure they exist in the archive
     if (!file_list_is_subset(files, &archive_files)) {
         printf("Error: One or more of the specified files is not already present in archive");
+        archive_index_clear(&index);
         file_list_clear(&archive_files);
         fclose(archive);
         return -1;
     }
-    // seek to the end of the archive minus the last two 0 header blocks
-    fseek(archive, -2 * BLOCK_SIZE, SEEK_END);
+    // new members go after the old end-of-archive marker, which stays in place
+    // until they are published, skipping the block of the first new header
+    off_t old_end = index.end;
+    fseek(archive, old_end + BLOCK_SIZE, SEEK_SET);
+    archive_index_clear(&index);
 
     // get the first file node from the argument list
     node_t *curr_file = files->head;
@@ -342,6 +953,7 @@ int update_archive(const char *archive_name, file_list_t *files) {
         return -1;
     }
 
+    tar_header first_header;
     while (curr_file != NULL) {
         // use function to fill header, then error check
         int tar_error = fill_tar_header(curr_header, curr_file->name);
@@ -353,10 +965,10 @@ int update_archive(const char *archive_name, file_list_t *files) {
             perror(err_msg);
             return -1;
         }
-        // write the file header to the archive file
-        size_t header_bytes_written = fwrite(curr_header, sizeof(tar_header), 1, archive);
-        // should only write 1 element
-        if (header_bytes_written != 1) {
+        // write the file header to the archive file; the first is written last
+        if (curr_file == files->head) {
+            memcpy(&first_header, curr_header, sizeof(tar_header));
+        } else if (fwrite(curr_header, sizeof(tar_header), 1, archive) != 1) {
             free(curr_header);
             fclose(archive);
             snprintf(err_msg, MAX_MSG_LEN, "Failed to write minitar header for %s\n",
@@ -405,10 +1017,15 @@ int update_archive(const char *archive_name, file_list_t *files) {
         curr_file = curr_file->next;
     }
 
-    // write new footer
+    // write new footer, then make the new members visible
     write_tar_footer(archive);
     free(curr_header);
     file_list_clear(&archive_files);
+    if (fflush(archive) != 0 ||
+        (files->head != NULL && publish_members(fd, &first_header, old_end) != 0)) {
+        fclose(archive);
+        return -1;
+    }
     if (fclose(archive) == EOF) {
         perror("Error: Failed to close archive.");
         return -1;
@@ -416,163 +1033,1234 @@ int update_archive(const char *archive_name, file_list_t *files) {
     return 0;
 }
 
-int get_archive_file_list(const char *archive_name, file_list_t *files) {
+int create_incremental_archive(const char *archive_name, const file_list_t *files,
+                               const char *snapshot_name) {
     char err_msg[MAX_MSG_LEN];
-    FILE *minitar = fopen(archive_name, "r");
-    // error check file open of the archive
-    if (minitar == NULL) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to open file for reading %s\n", archive_name);
-        perror(err_msg);
-        return -1;
-    }
-    // initialize header var to read headers into
-    tar_header *header = malloc(sizeof(tar_header));
-    if (header == NULL) {
-        fclose(minitar);
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to allocate memory for header\n");
+    snapshot_t previous;
+    snapshot_t current;
+    snapshot_init(&previous);
+    snapshot_init(&current);
+    file_list_t changed;
+    file_list_t deleted;
+    file_list_init(&changed);
+    file_list_init(&deleted);
+
+    int result = 0;
+    if (snapshot_load(&previous, snapshot_name) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to read snapshot %s", snapshot_name);
         perror(err_msg);
-        return -1;
+        result = -1;
     }
-    // initialize block to read the potential second zero block in
-    char block[BLOCK_SIZE] = {0};
-    // while true
-    while (1) {
-        // resets header to 0 before reading in
-        memset(header, 0, sizeof(tar_header));
-        // read the header block in
-        size_t bytes_read = fread(header, 1, BLOCK_SIZE, minitar);
-        if (bytes_read != BLOCK_SIZE) {
-            free(header);
-            fclose(minitar);
-            snprintf(err_msg, MAX_MSG_LEN, "Failed to read header from file %s\n", archive_name);
+    // stat each file once; anything new or different since the previous run is archived
+    for (node_t *curr_file = files->head; result == 0 && curr_file != NULL;
+         curr_file = curr_file->next) {
+        struct stat stat_buf;
+        if (stat(curr_file->name, &stat_buf) != 0) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to stat file %s", curr_file->name);
             perror(err_msg);
-            return -1;
+            result = -1;
+            break;
         }
-        // check if block read is all zeros, if it is check next
-        if (is_all_zeros((const char *) header)) {
-            // if in here, block just read is all zeros, need to check next block
-            bytes_read = fread(block, 1, BLOCK_SIZE, minitar);
-            if (bytes_read == BLOCK_SIZE && is_all_zeros(block)) {
-                // two consecutive zero blocks so break from the loop
-                break;
-            }
+        // a file named twice is only archived once
+        if (snapshot_find(&current, curr_file->name) != NULL) {
+            continue;
         }
-        // add files to the linked list
-        if (file_list_add(files, header->name) == 1) {
-            free(header);
-            fclose(minitar);
-            snprintf(err_msg, MAX_MSG_LEN, "Failed to add file to the file list\n");
-            perror(err_msg);
-            return -1;
+        const snapshot_entry_t *entry = snapshot_find(&previous, curr_file->name);
+        if (snapshot_add(&current, curr_file->name, &stat_buf) != 0 ||
+            ((entry == NULL || !snapshot_entry_matches(entry, &stat_buf)) &&
+             file_list_add(&changed, curr_file->name) != 0)) {
+            perror("Failed to record file state");
+            result = -1;
         }
-        // convert the octal string to a long
-        long file_size = strtol(header->size, NULL, 8);
-        // calculate the number of blocks to seek
-        // (Block_Size represents the header we read in, file size is the length of the file we are
-        // about to skip) by  diving by block size we get the number of blocks to skip, can multiply
-        // by 512 to get bytes to seek
-        size_t blocks_seek = (file_size + BLOCK_SIZE) / BLOCK_SIZE;
-        fseek(minitar, blocks_seek * BLOCK_SIZE, SEEK_CUR);
     }
-    free(header);
-    fclose(minitar);
+    // files in the previous snapshot that are no longer part of the backup were deleted
+    for (int i = 0; result == 0 && i < previous.size; i++) {
+        if (snapshot_find(&current, previous.entries[i].name) == NULL &&
+            file_list_add(&deleted, previous.entries[i].name) != 0) {
+            perror("Failed to record deleted file");
+            result = -1;
+        }
+    }
+
+    // the deletion records go into the same new archive, so readers never see
+    // the changes without them
+    if (result == 0) {
+        result = create_archive_with_deletions(archive_name, &changed, &deleted);
+    }
+    // only move the snapshot forward once the backup holding the changes is complete
+    if (result == 0 && snapshot_save(&current, snapshot_name) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to write snapshot %s", snapshot_name);
+        perror(err_msg);
+        result = -1;
+    }
+    file_list_clear(&changed);
+    file_list_clear(&deleted);
+    snapshot_clear(&previous);
+    snapshot_clear(&current);
+    return result;
+}
+
+/*
+ * Copy 'len' bytes starting at byte offset 'in_offset' of 'in_fd' to byte
+ * offset 'out_offset' of 'out_fd' with copy_file_range(), so the kernel moves
+ * the data without passing it through user space, and filesystems that can
+ * (e.g. btrfs or XFS) share the extents instead of copying them. Falls back to
+ * ordinary reads and writes if the kernel cannot do this for the pair of
+ * files (e.g. across filesystems on older kernels).
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int copy_archive_range(int in_fd, off_t in_offset, int out_fd, off_t out_offset,
+                              size_t len) {
+    int zero_copy = 1;
+    while (len > 0 && zero_copy) {
+        ssize_t n = copy_file_range(in_fd, &in_offset, out_fd, &out_offset, len, 0);
+        if (n > 0) {
+            len -= n;
+        } else if (n == 0) {
+            // source ended early
+            return -1;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                   errno == EOPNOTSUPP) {
+            zero_copy = 0;
+        } else {
+            return -1;
+        }
+    }
+    char buf[BLOCK_SIZE * 16];
+    while (len > 0) {
+        size_t to_read = len < sizeof(buf) ? len : sizeof(buf);
+        ssize_t n = pread(in_fd, buf, to_read, in_offset);
+        if (n <= 0) {
+            return -1;
+        }
+        for (ssize_t written = 0; written < n;) {
+            ssize_t w = pwrite(out_fd, buf + written, n - written, out_offset + written);
+            if (w < 0 && errno != EINTR) {
+                return -1;
+            }
+            written += w > 0 ? w : 0;
+        }
+        in_offset += n;
+        out_offset += n;
+        len -= n;
+    }
     return 0;
 }
 
-int extract_files_from_archive(const char *archive_name) {
+// A member of one of the archives being concatenated
+typedef struct {
+    // Header name field of the member, which need not be null-terminated
+    const char *name;
+    // Position of the member's archive among the sources
+    int source;
+    // Position of the member within the index of its archive
+    int member;
+} member_ref_t;
+
+// Compare function for sorting member references by name, then by position
+static int compare_member_refs(const void *a, const void *b) {
+    const member_ref_t *x = a;
+    const member_ref_t *y = b;
+    int cmp = strncmp(x->name, y->name, HEADER_NAME_LEN);
+    if (cmp != 0) {
+        return cmp;
+    }
+    if (x->source != y->source) {
+        return x->source - y->source;
+    }
+    return x->member - y->member;
+}
+
+/*
+ * Like mark_superseded_members(), but across the 'num_sources' archives
+ * 'indexes', taken in order: sets superseded[s][i] to 1 for each member i of
+ * indexes[s] that has a later member of the same name in any of them.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int mark_superseded_across(const archive_index_t *indexes, int num_sources,
+                                  char **superseded) {
+    int n = 0;
+    for (int s = 0; s < num_sources; s++) {
+        n += indexes[s].size;
+    }
+    member_ref_t *refs = malloc(n * sizeof(member_ref_t) + 1);
+    if (refs == NULL) {
+        return -1;
+    }
+    int k = 0;
+    for (int s = 0; s < num_sources; s++) {
+        for (int i = 0; i < indexes[s].size; i++) {
+            refs[k].name = indexes[s].members[i].header.name;
+            refs[k].source = s;
+            refs[k].member = i;
+            k++;
+        }
+    }
+    qsort(refs, n, sizeof(member_ref_t), compare_member_refs);
+    for (int i = 0; i < n; i++) {
+        superseded[refs[i].source][refs[i].member] =
+            i + 1 < n && strncmp(refs[i].name, refs[i + 1].name, HEADER_NAME_LEN) == 0;
+    }
+    free(refs);
+    return 0;
+}
+
+int concatenate_archives(const char *archive_name, const file_list_t *sources, int dedupe) {
     char err_msg[MAX_MSG_LEN];
-    FILE *minitar = fopen(archive_name, "r");
-    if (minitar == NULL) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to open minitar file %s\n", archive_name);
-        perror(err_msg);
+    int num_sources = sources->size;
+    int *source_fds = malloc(num_sources * sizeof(int) + 1);
+    archive_index_t *indexes = malloc(num_sources * sizeof(archive_index_t) + 1);
+    char **superseded = calloc(num_sources + 1, sizeof(char *));
+    if (source_fds == NULL || indexes == NULL || superseded == NULL) {
+        perror("Failed to allocate memory for concatenation");
+        free(source_fds);
+        free(indexes);
+        free(superseded);
         return -1;
     }
-    // initialize variabales for reading / writing
-    tar_header *curr_header = malloc(sizeof(tar_header));
-    if (curr_header == NULL) {
-        fclose(minitar);
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to allocate memory for header\n");
+    for (int s = 0; s < num_sources; s++) {
+        source_fds[s] = -1;
+        archive_index_init(&indexes[s]);
+    }
+
+    int result = 0;
+    off_t old_end = 0;
+    int fd = open_locked_archive(archive_name);
+    if (fd == -1) {
+        result = -1;
+    } else {
+        archive_index_t index;
+        archive_index_init(&index);
+        result = load_index_from_fd(fd, archive_name, &index, 1);
+        old_end = index.end;
+        archive_index_clear(&index);
+    }
+    // index every source; one may be the target itself, which is only read up
+    // to its old end as nothing new is published until the copy is complete
+    node_t *curr_source = sources->head;
+    for (int s = 0; result == 0 && s < num_sources; s++, curr_source = curr_source->next) {
+        source_fds[s] = open_archive(curr_source->name);
+        if (source_fds[s] == -1 ||
+            load_index_from_fd(source_fds[s], curr_source->name, &indexes[s], 0) != 0) {
+            result = -1;
+        } else if ((superseded[s] = calloc(indexes[s].size + 1, 1)) == NULL) {
+            perror("Failed to allocate memory for concatenation");
+            result = -1;
+        }
+    }
+    if (result == 0 && dedupe && mark_superseded_across(indexes, num_sources, superseded) != 0) {
+        perror("Failed to find latest members");
+        result = -1;
+    }
+
+    // members are stored back to back, so each run of members kept from a
+    // source is copied in one go; the first header is held back to publish them
+    tar_header first_header;
+    int have_first_header = 0;
+    off_t out_offset = old_end;
+    for (int s = 0; result == 0 && s < num_sources; s++) {
+        const archive_index_t *source = &indexes[s];
+        int i = 0;
+        while (result == 0 && i < source->size) {
+            if (superseded[s][i]) {
+                i++;
+                continue;
+            }
+            int j = i + 1;
+            while (j < source->size && !superseded[s][j]) {
+                j++;
+            }
+            off_t start = source->members[i].offset;
+            off_t end = j < source->size ? source->members[j].offset : source->end;
+            if (!have_first_header) {
+                memcpy(&first_header, &source->members[i].header, sizeof(tar_header));
+                have_first_header = 1;
+                start += BLOCK_SIZE;
+                out_offset += BLOCK_SIZE;
+            }
+            if (copy_archive_range(source_fds[s], start, fd, out_offset, end - start) != 0) {
+                snprintf(err_msg, MAX_MSG_LEN, "Failed to copy members to archive %s",
+                         archive_name);
+                perror(err_msg);
+                result = -1;
+            }
+            out_offset += end - start;
+            i = j;
+        }
+    }
+    if (result == 0 && have_first_header) {
+        char zeros[BLOCK_SIZE * NUM_TRAILING_BLOCKS] = {0};
+        if (pwrite(fd, zeros, sizeof(zeros), out_offset) != sizeof(zeros)) {
+            perror("Failed to write archive footer");
+            result = -1;
+        } else {
+            result = publish_members(fd, &first_header, old_end);
+        }
+    }
+
+    for (int s = 0; s < num_sources; s++) {
+        if (source_fds[s] != -1) {
+            close(source_fds[s]);
+        }
+        archive_index_clear(&indexes[s]);
+        free(superseded[s]);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    free(source_fds);
+    free(indexes);
+    free(superseded);
+    return result;
+}
+
+static int get_sharded_archive_file_list(const char *archive_name, file_list_t *files);
+static int extract_sharded_archive(const char *archive_name);
+
+int get_archive_file_list(const char *archive_name, file_list_t *files) {
+    if (is_sharded_archive(archive_name)) {
+        return get_sharded_archive_file_list(archive_name, files);
+    }
+    archive_index_t index;
+    archive_index_init(&index);
+    if (archive_index_load(archive_name, &index) != 0) {
+        return -1;
+    }
+    // add files to the linked list
+    int result = index_file_list(&index, files);
+    if (result != 0) {
+        perror("Failed to add file to the file list");
+    }
+    archive_index_clear(&index);
+    return result;
+}
+
+/*
+ * Write the contents of 'member', read from the archive open as 'fd', to a new
+ * file of the same name in the current working directory, or remove that file
+ * if 'member' records its deletion.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int extract_member(int fd, const archive_member_t *member, char *buf) {
+    char err_msg[MAX_MSG_LEN];
+    char curr_file_name[HEADER_NAME_LEN + 1];
+    copy_member_name(curr_file_name, &member->header);
+    // restoring an incremental backup removes files deleted since the last one
+    if (member->header.typeflag == DELTYPE) {
+        if (unlink(curr_file_name) != 0 && errno != ENOENT) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to remove %s", curr_file_name);
+            perror(err_msg);
+            return -1;
+        }
+        return 0;
+    }
+    FILE *curr_file = fopen(curr_file_name, "w");
+    if (curr_file == NULL) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to open file for writing\n");
         perror(err_msg);
         return -1;
     }
-    char curr_file_name[100];    // size of filename
-    long curr_file_size;
-    size_t bytes_read;
-    size_t total_bytes_remaining;
-    size_t bytes_written;
-    size_t bytes_to_write;
-    char stored_data[BLOCK_SIZE];
-    // initialize block to read the potential second zero block in
-    char block[BLOCK_SIZE] = {0};
-    // while true
-    while (1) {
-        // resets header to 0 before reading in
-        memset(curr_header, 0, sizeof(tar_header));
-        // read in header
-        bytes_read = fread(curr_header, 1, BLOCK_SIZE, minitar);
-        if (bytes_read != BLOCK_SIZE) {
-            free(curr_header);
-            fclose(minitar);
-            snprintf(err_msg, MAX_MSG_LEN, "Failed to read tar header in file %s\n", archive_name);
+    off_t offset = member->offset + BLOCK_SIZE;
+    size_t total_bytes_remaining = member->size;
+    // read and write bytes until we have none remaining
+    while (total_bytes_remaining > 0) {
+        size_t bytes_to_write =
+            total_bytes_remaining < CHUNK_SIZE ? total_bytes_remaining : CHUNK_SIZE;
+        if (pread(fd, buf, bytes_to_write, offset) != bytes_to_write) {
+            fclose(curr_file);
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to read data block\n");
             perror(err_msg);
             return -1;
         }
-        // check if block read is all zeros, if it is check next
-        if (is_all_zeros((const char *) curr_header)) {
-            // if in here, block just read is all zeros, need to check next block
-            bytes_read = fread(block, 1, BLOCK_SIZE, minitar);
-            if (bytes_read == BLOCK_SIZE && is_all_zeros(block)) {
-                // two consecutive zero blocks so break from the loop
-                break;
-            }
+        if (fwrite(buf, 1, bytes_to_write, curr_file) != bytes_to_write) {
+            fclose(curr_file);
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to write correct amount of bytes\n");
+            perror(err_msg);
+            return -1;
         }
-        // safe copy the string exactly length of filename
-        strncpy(curr_file_name, curr_header->name, sizeof(curr_file_name));
-        curr_file_size = strtol(curr_header->size, NULL, 8);
+        offset += bytes_to_write;
+        total_bytes_remaining -= bytes_to_write;
+    }
+    return fclose(curr_file) == 0 ? 0 : -1;
+}
 
-        FILE *curr_file = fopen(curr_file_name, "w");
-        if (curr_file == NULL) {
-            free(curr_header);
-            fclose(minitar);
-            snprintf(err_msg, MAX_MSG_LEN, "Failed to open file for writing\n");
-            perror(err_msg);
+/*
+ * Copy 'len' bytes starting at byte offset 'offset' of the archive open as
+ * 'fd' to 'out_fd' without passing them through user space: splice() when
+ * 'out_fd' is a pipe, sendfile() otherwise (e.g. a socket or regular file).
+ * Falls back to ordinary reads and writes if the kernel cannot do either for
+ * this pair of descriptors (e.g. 'out_fd' is a terminal).
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int send_member_contents(int fd, off_t offset, size_t len, int out_fd) {
+    struct stat out_stat;
+    int is_pipe = fstat(out_fd, &out_stat) == 0 && S_ISFIFO(out_stat.st_mode);
+    int zero_copy = 1;
+    while (len > 0 && zero_copy) {
+        ssize_t n;
+        if (is_pipe) {
+            n = splice(fd, &offset, out_fd, NULL, len, SPLICE_F_MORE);
+        } else {
+            n = sendfile(out_fd, fd, &offset, len);
+        }
+        if (n > 0) {
+            len -= n;
+        } else if (n == 0) {
+            // archive ended early
+            return -1;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EINVAL || errno == ENOSYS) {
+            zero_copy = 0;
+        } else {
+            return -1;
+        }
+    }
+    char buf[BLOCK_SIZE * 16];
+    while (len > 0) {
+        size_t to_read = len < sizeof(buf) ? len : sizeof(buf);
+        ssize_t n = pread(fd, buf, to_read, offset);
+        if (n <= 0) {
             return -1;
         }
+        for (ssize_t written = 0; written < n;) {
+            ssize_t w = write(out_fd, buf + written, n - written);
+            if (w < 0 && errno != EINTR) {
+                return -1;
+            }
+            written += w > 0 ? w : 0;
+        }
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Returns the position in 'index' of the last member named 'name', or -1 if there is none
+static int find_latest_member(const archive_index_t *index, const char *name) {
+    for (int i = index->size - 1; i >= 0; i--) {
+        if (strncmp(index->members[i].header.name, name, HEADER_NAME_LEN) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
 
-        total_bytes_remaining = curr_file_size;
-        // read and write bytes until wev have none remaining
-        while (total_bytes_remaining > 0) {
-            bytes_read = fread(stored_data, 1, BLOCK_SIZE, minitar);
-            if (bytes_read != BLOCK_SIZE) {
-                free(curr_header);
-                fclose(minitar);
-                fclose(curr_file);
-                snprintf(err_msg, MAX_MSG_LEN, "Failed to read data block\n");
+int extract_files_to_stdout(const char *archive_name, const file_list_t *files) {
+    char err_msg[MAX_MSG_LEN];
+    if (is_sharded_archive(archive_name)) {
+        fprintf(stderr, "Extracting to stdout is not supported for sharded archive %s\n",
+                archive_name);
+        return -1;
+    }
+    int fd = open_archive(archive_name);
+    if (fd == -1) {
+        return -1;
+    }
+    archive_index_t index;
+    archive_index_init(&index);
+    if (load_index_from_fd(fd, archive_name, &index, 0) != 0) {
+        close(fd);
+        return -1;
+    }
+    // nothing may be left sitting in stdio's buffer ahead of the member contents
+    fflush(stdout);
+    int result = 0;
+    if (files->size > 0) {
+        for (node_t *curr_file = files->head; curr_file != NULL; curr_file = curr_file->next) {
+            int i = find_latest_member(&index, curr_file->name);
+            if (i == -1 || index.members[i].header.typeflag == DELTYPE) {
+                fprintf(stderr, "%s: Not found in archive\n", curr_file->name);
+                result = -1;
+            } else if (send_member_contents(fd, index.members[i].offset + BLOCK_SIZE,
+                                            index.members[i].size, STDOUT_FILENO) != 0) {
+                snprintf(err_msg, MAX_MSG_LEN, "Failed to write %s to stdout", curr_file->name);
                 perror(err_msg);
-                return -1;
+                result = -1;
+                break;
             }
+        }
+    } else {
+        // with no names given, write out the latest version of every file
+        char *superseded = malloc(index.size + 1);
+        if (superseded == NULL || mark_superseded_members(&index, superseded) != 0) {
+            perror("Failed to allocate memory for extraction");
+            result = -1;
+        }
+        for (int i = 0; result == 0 && i < index.size; i++) {
+            if (!superseded[i] && index.members[i].header.typeflag != DELTYPE &&
+                send_member_contents(fd, index.members[i].offset + BLOCK_SIZE,
+                                     index.members[i].size, STDOUT_FILENO) != 0) {
+                perror("Failed to write archive member to stdout");
+                result = -1;
+            }
+        }
+        free(superseded);
+    }
+    archive_index_clear(&index);
+    close(fd);
+    return result;
+}
 
-            // this would indicate that this block
-            if (total_bytes_remaining < BLOCK_SIZE) {
-                bytes_to_write = total_bytes_remaining;
-            } else {
-                bytes_to_write = BLOCK_SIZE;
+int extract_files_from_archive(const char *archive_name) {
+    if (is_sharded_archive(archive_name)) {
+        return extract_sharded_archive(archive_name);
+    }
+    int fd = open_archive(archive_name);
+    if (fd == -1) {
+        return -1;
+    }
+    archive_index_t index;
+    archive_index_init(&index);
+    if (load_index_from_fd(fd, archive_name, &index, 0) != 0) {
+        close(fd);
+        return -1;
+    }
+    // only the most recent version of each file needs to be written out
+    char *superseded = malloc(index.size + 1);
+    char *buf = malloc(CHUNK_SIZE);
+    int result = 0;
+    if (superseded == NULL || buf == NULL || mark_superseded_members(&index, superseded) != 0) {
+        perror("Failed to allocate memory for extraction");
+        result = -1;
+    }
+    for (int i = 0; result == 0 && i < index.size; i++) {
+        if (!superseded[i]) {
+            result = extract_member(fd, &index.members[i], buf);
+        }
+    }
+    free(superseded);
+    free(buf);
+    archive_index_clear(&index);
+    close(fd);
+    return result;
+}
+
+// Bit flags describing how a member differs from the file on disk
+#define DIFF_MISSING 0x01
+#define DIFF_MODE 0x02
+#define DIFF_UID 0x04
+#define DIFF_GID 0x08
+#define DIFF_SIZE 0x10
+#define DIFF_MTIME 0x20
+#define DIFF_CONTENTS 0x40
+#define DIFF_READ_ERROR 0x80
+
+typedef struct {
+    int flags;
+    // errno value describing a missing file or read error
+    int error;
+} verify_result_t;
+
+// State shared by all verify worker threads
+typedef struct {
+    const archive_index_t *index;
+    const char *superseded;
+    verify_result_t *results;
+    int archive_fd;
+    // Next member to be claimed by a worker
+    int next_member;
+    pthread_mutex_t lock;
+} verify_job_t;
+
+/*
+ * Stream the contents of 'member' from the archive and the file open as 'fd'
+ * side by side, comparing them one chunk at a time.
+ * Returns 0 if the contents match, DIFF_CONTENTS if they differ, or
+ * DIFF_READ_ERROR if either could not be read.
+ */
+static int compare_member_contents(int archive_fd, const archive_member_t *member, int fd,
+                                   char *archive_buf, char *file_buf) {
+    off_t archive_offset = member->offset + BLOCK_SIZE;
+    size_t remaining = member->size;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    while (remaining > 0) {
+        size_t to_read = remaining < CHUNK_SIZE ? remaining : CHUNK_SIZE;
+        ssize_t archive_bytes = pread(archive_fd, archive_buf, to_read, archive_offset);
+        if (archive_bytes <= 0) {
+            return DIFF_READ_ERROR;
+        }
+        // the file may return fewer bytes per call, so fill the buffer fully
+        size_t file_bytes = 0;
+        while (file_bytes < archive_bytes) {
+            ssize_t n = read(fd, file_buf + file_bytes, archive_bytes - file_bytes);
+            if (n < 0) {
+                return DIFF_READ_ERROR;
             }
+            if (n == 0) {
+                // file shrank since we stat-ed it
+                return DIFF_CONTENTS;
+            }
+            file_bytes += n;
+        }
+        if (memcmp(archive_buf, file_buf, archive_bytes) != 0) {
+            return DIFF_CONTENTS;
+        }
+        archive_offset += archive_bytes;
+        remaining -= archive_bytes;
+    }
+    return 0;
+}
 
-            bytes_written = fwrite(stored_data, 1, bytes_to_write, curr_file);
-            if (bytes_written != bytes_to_write) {
-                free(curr_header);
-                fclose(minitar);
-                fclose(curr_file);
-                snprintf(err_msg, MAX_MSG_LEN, "Failed to write correct amount of bytes\n");
-                perror(err_msg);
-                return -1;
+// Compare a single member's header and contents against the file on disk
+static void verify_member(verify_job_t *job, int i, char *archive_buf, char *file_buf) {
+    const archive_member_t *member = &job->index->members[i];
+    verify_result_t *result = &job->results[i];
+    char name[HEADER_NAME_LEN + 1];
+    copy_member_name(name, &member->header);
+
+    int fd = open(name, O_RDONLY);
+    struct stat stat_buf;
+    if (fd == -1 || fstat(fd, &stat_buf) != 0) {
+        result->flags = DIFF_MISSING;
+        result->error = errno;
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+    // the header was validated when the archive was indexed
+    header_fields_t fields;
+    header_decode(&member->header, &fields);
+    if ((stat_buf.st_mode & 07777) != fields.mode) {
+        result->flags |= DIFF_MODE;
+    }
+    if (stat_buf.st_uid != fields.uid) {
+        result->flags |= DIFF_UID;
+    }
+    if (stat_buf.st_gid != fields.gid) {
+        result->flags |= DIFF_GID;
+    }
+    if ((stat_buf.st_mtime < 0 ? 0 : stat_buf.st_mtime) != fields.mtime) {
+        result->flags |= DIFF_MTIME;
+    }
+    // contents can only match if the sizes do, so skip reading them otherwise
+    if (stat_buf.st_size != member->size) {
+        result->flags |= DIFF_SIZE;
+    } else {
+        result->flags |=
+            compare_member_contents(job->archive_fd, member, fd, archive_buf, file_buf);
+        if (result->flags & DIFF_READ_ERROR) {
+            result->error = errno;
+        }
+    }
+    close(fd);
+}
+
+// Worker thread: repeatedly claim the next unchecked member and verify it
+static void *verify_worker(void *arg) {
+    verify_job_t *job = arg;
+    char *archive_buf = malloc(CHUNK_SIZE);
+    char *file_buf = malloc(CHUNK_SIZE);
+    if (archive_buf == NULL || file_buf == NULL) {
+        free(archive_buf);
+        free(file_buf);
+        return (void *) -1;
+    }
+    while (1) {
+        pthread_mutex_lock(&job->lock);
+        int i = job->next_member++;
+        pthread_mutex_unlock(&job->lock);
+        if (i >= job->index->size) {
+            break;
+        }
+        if (!job->superseded[i] && job->index->members[i].header.typeflag != DELTYPE) {
+            verify_member(job, i, archive_buf, file_buf);
+        }
+    }
+    free(archive_buf);
+    free(file_buf);
+    return NULL;
+}
+
+// Print a line on stdout for each difference recorded in 'result'
+static int report_differences(const char *name, const verify_result_t *result) {
+    if (result->flags & DIFF_MISSING) {
+        printf("%s: Warning: Cannot stat: %s\n", name, strerror(result->error));
+        return 1;
+    }
+    if (result->flags & DIFF_MODE) {
+        printf("%s: Mode differs\n", name);
+    }
+    if (result->flags & DIFF_UID) {
+        printf("%s: Uid differs\n", name);
+    }
+    if (result->flags & DIFF_GID) {
+        printf("%s: Gid differs\n", name);
+    }
+    if (result->flags & DIFF_MTIME) {
+        printf("%s: Mod time differs\n", name);
+    }
+    if (result->flags & DIFF_SIZE) {
+        printf("%s: Size differs\n", name);
+    }
+    if (result->flags & DIFF_CONTENTS) {
+        printf("%s: Contents differ\n", name);
+    }
+    if (result->flags & DIFF_READ_ERROR) {
+        printf("%s: Read error: %s\n", name, strerror(result->error));
+    }
+    return result->flags != 0;
+}
+
+int verify_archive(const char *archive_name) {
+    verify_job_t job;
+    job.next_member = 0;
+    job.archive_fd = open_archive(archive_name);
+    if (job.archive_fd == -1) {
+        return -1;
+    }
+    archive_index_t index;
+    archive_index_init(&index);
+    if (load_index_from_fd(job.archive_fd, archive_name, &index, 0) != 0) {
+        close(job.archive_fd);
+        return -1;
+    }
+    job.index = &index;
+    posix_fadvise(job.archive_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    char *superseded = malloc(index.size + 1);
+    job.results = calloc(index.size + 1, sizeof(verify_result_t));
+    if (superseded == NULL || job.results == NULL ||
+        mark_superseded_members(&index, superseded) != 0) {
+        free(superseded);
+        free(job.results);
+        close(job.archive_fd);
+        archive_index_clear(&index);
+        perror("Failed to allocate memory for verification");
+        return -1;
+    }
+    job.superseded = superseded;
+    pthread_mutex_init(&job.lock, NULL);
+
+    // one worker per processor, but never more than there are members
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    if (num_threads > MAX_VERIFY_THREADS) {
+        num_threads = MAX_VERIFY_THREADS;
+    }
+    if (num_threads > index.size) {
+        num_threads = index.size;
+    }
+    pthread_t threads[MAX_VERIFY_THREADS];
+    int result = 0;
+    int started = 0;
+    for (; started < num_threads; started++) {
+        if (pthread_create(&threads[started], NULL, verify_worker, &job) != 0) {
+            perror("Failed to start verify thread");
+            result = -1;
+            break;
+        }
+    }
+    // if no thread could be started at all, do the work on this one
+    if (started == 0 && index.size > 0) {
+        result = verify_worker(&job) == NULL ? 0 : -1;
+    }
+    for (int i = 0; i < started; i++) {
+        void *ret;
+        pthread_join(threads[i], &ret);
+        if (ret != NULL) {
+            result = -1;
+        }
+    }
+
+    // report in archive order so output does not depend on thread scheduling
+    if (result == 0) {
+        for (int i = 0; i < index.size; i++) {
+            char name[HEADER_NAME_LEN + 1];
+            copy_member_name(name, &index.members[i].header);
+            if (report_differences(name, &job.results[i])) {
+                result = 1;
             }
-            total_bytes_remaining -= bytes_written;
         }
-        fclose(curr_file);
+    } else {
+        fprintf(stderr, "Failed to verify archive %s\n", archive_name);
+    }
+
+    pthread_mutex_destroy(&job.lock);
+    free(superseded);
+    free(job.results);
+    close(job.archive_fd);
+    archive_index_clear(&index);
+    return result;
+}
+
+// Build the name of shard number 'shard' of the archive 'archive_name'
+static void shard_name(char *dest, const char *archive_name, int shard) {
+    snprintf(dest, PATH_MAX, "%s.%d", archive_name, shard);
+}
+
+// Build the name of the manifest of the sharded archive 'archive_name'
+static void manifest_name(char *dest, const char *archive_name) {
+    snprintf(dest, PATH_MAX, "%s.manifest", archive_name);
+}
+
+int is_sharded_archive(const char *archive_name) {
+    char manifest[PATH_MAX];
+    manifest_name(manifest, archive_name);
+    return access(archive_name, F_OK) != 0 && access(manifest, F_OK) == 0;
+}
+
+// One file to be placed in a shard, along with the space it takes up there
+typedef struct {
+    const char *name;
+    // Position of the file in the list given by the caller
+    int position;
+    // Bytes taken up by the file's header and padded contents
+    off_t bytes;
+    int shard;
+} shard_entry_t;
+
+static int compare_entry_names(const void *a, const void *b) {
+    const shard_entry_t *x = a;
+    const shard_entry_t *y = b;
+    int cmp = strcmp(x->name, y->name);
+    return cmp != 0 ? cmp : x->position - y->position;
+}
+
+// Sort by decreasing size, so the largest files are placed first
+static int compare_entry_bytes(const void *a, const void *b) {
+    const shard_entry_t *x = *(const shard_entry_t **) a;
+    const shard_entry_t *y = *(const shard_entry_t **) b;
+    if (x->bytes != y->bytes) {
+        return x->bytes < y->bytes ? 1 : -1;
+    }
+    return x->position - y->position;
+}
+
+static int compare_entry_positions(const void *a, const void *b) {
+    return ((const shard_entry_t *) a)->position - ((const shard_entry_t *) b)->position;
+}
+
+/*
+ * Assign each of the 'n' entries to a shard. Entries with the same name are
+ * treated as a single unit and placed in the same shard, so that extraction
+ * from separate shards never races on one file. If 'capacity' is 0, the units
+ * are spread over 'num_shards' shards so that the total bytes in each shard
+ * are roughly equal. Otherwise each unit, largest first, goes into the first
+ * shard with room for it within 'capacity' bytes, and a new shard is started
+ * when none has room. On return, 'entries' is back in the caller's original
+ * order.
+ * Returns the number of shards used on success or -1 if an error occurs,
+ * including a unit that does not fit in 'capacity' bytes
+ */
+static int assign_shards(shard_entry_t *entries, int n, int num_shards, off_t capacity) {
+    // never more shards in use than groups of entries
+    int max_shards = capacity > 0 ? n + 1 : num_shards;
+    off_t *loads = calloc(max_shards, sizeof(off_t));
+    shard_entry_t **groups = malloc(n * sizeof(shard_entry_t *) + 1);
+    if (loads == NULL || groups == NULL) {
+        perror("Failed to assign files to shards");
+        free(loads);
+        free(groups);
+        return -1;
+    }
+    // group entries by name; the first entry of each group carries its total size
+    qsort(entries, n, sizeof(shard_entry_t), compare_entry_names);
+    int num_groups = 0;
+    for (int i = 0; i < n; i++) {
+        if (i > 0 && strcmp(entries[i].name, entries[i - 1].name) == 0) {
+            groups[num_groups - 1]->bytes += entries[i].bytes;
+        } else {
+            groups[num_groups++] = &entries[i];
+        }
+    }
+    qsort(groups, num_groups, sizeof(shard_entry_t *), compare_entry_bytes);
+    if (capacity > 0) {
+        // first fit: the largest groups open new shards and smaller ones fill the gaps
+        num_shards = 0;
+        for (int i = 0; i < num_groups; i++) {
+            if (groups[i]->bytes > capacity) {
+                fprintf(stderr, "File %s does not fit in a volume (%lld bytes available)\n",
+                        groups[i]->name, (long long) capacity);
+                errno = EFBIG;
+                num_shards = -1;
+                break;
+            }
+            int k = 0;
+            while (k < num_shards && loads[k] + groups[i]->bytes > capacity) {
+                k++;
+            }
+            if (k == num_shards) {
+                num_shards++;
+            }
+            groups[i]->shard = k;
+            loads[k] += groups[i]->bytes;
+        }
+    } else {
+        // greedily place each group, largest first, in the least loaded shard
+        for (int i = 0; i < num_groups; i++) {
+            int lightest = 0;
+            for (int k = 1; k < num_shards; k++) {
+                if (loads[k] < loads[lightest]) {
+                    lightest = k;
+                }
+            }
+            groups[i]->shard = lightest;
+            loads[lightest] += groups[i]->bytes;
+        }
+    }
+    // entries are still sorted by name, so each group is a contiguous run
+    for (int i = 1; i < n; i++) {
+        if (strcmp(entries[i].name, entries[i - 1].name) == 0) {
+            entries[i].shard = entries[i - 1].shard;
+        }
+    }
+    qsort(entries, n, sizeof(shard_entry_t), compare_entry_positions);
+    free(loads);
+    free(groups);
+    // an empty archive still gets a shard
+    return num_shards == 0 ? 1 : num_shards;
+}
+
+// Work done on a single shard by one thread
+typedef struct {
+    char archive_name[PATH_MAX];
+    file_list_t files;
+    int result;
+} shard_task_t;
+
+static void *create_shard(void *arg) {
+    shard_task_t *task = arg;
+    task->result = create_archive(task->archive_name, &task->files);
+    return NULL;
+}
+
+static void *list_shard(void *arg) {
+    shard_task_t *task = arg;
+    task->result = get_archive_file_list(task->archive_name, &task->files);
+    return NULL;
+}
+
+static void *extract_shard(void *arg) {
+    shard_task_t *task = arg;
+    task->result = extract_files_from_archive(task->archive_name);
+    return NULL;
+}
+
+/*
+ * Run 'work' on each of the 'num_tasks' shard tasks, each in its own thread.
+ * Returns 0 if every task succeeded or -1 otherwise
+ */
+static int run_shard_tasks(shard_task_t *tasks, int num_tasks, void *(*work)(void *)) {
+    pthread_t *threads = malloc(num_tasks * sizeof(pthread_t));
+    if (threads == NULL) {
+        perror("Failed to allocate memory for shard threads");
+        return -1;
+    }
+    int started = 0;
+    for (; started < num_tasks; started++) {
+        if (pthread_create(&threads[started], NULL, work, &tasks[started]) != 0) {
+            perror("Failed to start shard thread");
+            break;
+        }
+    }
+    // any shards that could not get their own thread are handled on this one
+    for (int i = started; i < num_tasks; i++) {
+        work(&tasks[i]);
+    }
+    int result = 0;
+    for (int i = 0; i < num_tasks; i++) {
+        if (i < started) {
+            pthread_join(threads[i], NULL);
+        }
+        if (tasks[i].result != 0) {
+            result = -1;
+        }
+    }
+    free(threads);
+    return result;
+}
+
+// Allocate 'num_shards' tasks, one for each shard of 'archive_name'
+static shard_task_t *make_shard_tasks(const char *archive_name, int num_shards) {
+    shard_task_t *tasks = malloc(num_shards * sizeof(shard_task_t));
+    if (tasks == NULL) {
+        perror("Failed to allocate memory for shards");
+        return NULL;
+    }
+    for (int k = 0; k < num_shards; k++) {
+        shard_name(tasks[k].archive_name, archive_name, k);
+        file_list_init(&tasks[k].files);
+        tasks[k].result = 0;
+    }
+    return tasks;
+}
+
+static void free_shard_tasks(shard_task_t *tasks, int num_shards) {
+    for (int k = 0; k < num_shards; k++) {
+        file_list_clear(&tasks[k].files);
+    }
+    free(tasks);
+}
+
+/*
+ * Write the manifest of 'archive_name', listing the shard of each of the 'n'
+ * entries in order. The manifest is written under a temporary name and then
+ * renamed, so it only appears once it is complete.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int write_manifest(const char *archive_name, const shard_entry_t *entries, int n,
+                          int num_shards) {
+    char err_msg[MAX_MSG_LEN];
+    char manifest[PATH_MAX];
+    char tmp_manifest[PATH_MAX + 4];
+    manifest_name(manifest, archive_name);
+    snprintf(tmp_manifest, sizeof(tmp_manifest), "%s.tmp", manifest);
+    FILE *fp = fopen(tmp_manifest, "w");
+    if (fp == NULL) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to open manifest for %s", archive_name);
+        perror(err_msg);
+        return -1;
+    }
+    fprintf(fp, "%s\nshards %d\n", MANIFEST_MAGIC, num_shards);
+    for (int i = 0; i < n; i++) {
+        fprintf(fp, "%d %s\n", entries[i].shard, entries[i].name);
+    }
+    if (fclose(fp) == EOF || rename(tmp_manifest, manifest) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to write manifest for %s", archive_name);
+        perror(err_msg);
+        unlink(tmp_manifest);
+        return -1;
     }
-    free(curr_header);
-    fclose(minitar);
     return 0;
 }
+
+/*
+ * Read the number of shards recorded in the manifest of 'archive_name', if it
+ * has one.
+ * Returns the number of shards, or 0 if there is no valid manifest
+ */
+static int read_manifest_shard_count(const char *archive_name) {
+    char manifest[PATH_MAX];
+    manifest_name(manifest, archive_name);
+    FILE *fp = fopen(manifest, "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    char line[MAX_MSG_LEN];
+    int num_shards;
+    if (fgets(line, sizeof(line), fp) == NULL ||
+        strncmp(line, MANIFEST_MAGIC "\n", sizeof(MANIFEST_MAGIC)) != 0 ||
+        fscanf(fp, "shards %d\n", &num_shards) != 1 || num_shards < 1) {
+        num_shards = 0;
+    }
+    fclose(fp);
+    return num_shards;
+}
+
+int create_sharded_archive(const char *archive_name, const file_list_t *files, int num_shards,
+                           off_t volume_size) {
+    char err_msg[MAX_MSG_LEN];
+    // only shards listed by the manifest being replaced are ours to remove
+    int old_num_shards = read_manifest_shard_count(archive_name);
+    int n = files->size;
+    shard_entry_t *entries = malloc(n * sizeof(shard_entry_t) + 1);
+    if (entries == NULL) {
+        perror("Failed to allocate memory for shard assignment");
+        return -1;
+    }
+    // size each file from stat so shards can be balanced before anything is read
+    node_t *curr_file = files->head;
+    for (int i = 0; i < n; i++, curr_file = curr_file->next) {
+        struct stat stat_buf;
+        if (stat(curr_file->name, &stat_buf) != 0) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to stat file %s", curr_file->name);
+            perror(err_msg);
+            free(entries);
+            return -1;
+        }
+        entries[i].name = curr_file->name;
+        entries[i].position = i;
+        entries[i].bytes =
+            BLOCK_SIZE + (stat_buf.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        entries[i].shard = 0;
+    }
+    // leave room in each volume for its footer
+    off_t capacity = 0;
+    if (volume_size > 0) {
+        capacity = volume_size - NUM_TRAILING_BLOCKS * BLOCK_SIZE;
+        if (capacity < BLOCK_SIZE) {
+            fprintf(stderr, "Volume size of %lld bytes is too small to hold any file\n",
+                    (long long) volume_size);
+            free(entries);
+            errno = EINVAL;
+            return -1;
+        }
+    } else if (num_shards < 1) {
+        num_shards = 1;
+    }
+
+    shard_task_t *tasks = NULL;
+    if ((num_shards = assign_shards(entries, n, num_shards, capacity)) == -1 ||
+        (tasks = make_shard_tasks(archive_name, num_shards)) == NULL) {
+        free(entries);
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (file_list_add(&tasks[entries[i].shard].files, entries[i].name) != 0) {
+            perror("Failed to add file to shard");
+            free_shard_tasks(tasks, num_shards);
+            free(entries);
+            return -1;
+        }
+    }
+
+    int result = run_shard_tasks(tasks, num_shards, create_shard);
+    if (result == 0) {
+        // a plain archive of the same name would hide the shards
+        if (unlink(archive_name) != 0 && errno != ENOENT) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to remove old archive %s", archive_name);
+            perror(err_msg);
+            result = -1;
+        } else {
+            result = write_manifest(archive_name, entries, n, num_shards);
+        }
+    }
+    // shards left over from an earlier archive with more of them
+    for (int k = num_shards; result == 0 && k < old_num_shards; k++) {
+        char stale_shard[PATH_MAX];
+        shard_name(stale_shard, archive_name, k);
+        if (unlink(stale_shard) != 0 && errno != ENOENT) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to remove old shard %d of %s", k,
+                     archive_name);
+            perror(err_msg);
+            result = -1;
+        }
+    }
+    free_shard_tasks(tasks, num_shards);
+    free(entries);
+    return result;
+}
+
+/*
+ * Read the manifest of the sharded archive 'archive_name'. The file names are
+ * added to 'names' in their original order, and a newly allocated array with
+ * the shard holding each is stored in '*shards'.
+ * Returns the number of shards on success or -1 if an error occurs
+ */
+static int read_manifest(const char *archive_name, file_list_t *names, int **shards) {
+    char err_msg[MAX_MSG_LEN];
+    char manifest[PATH_MAX];
+    manifest_name(manifest, archive_name);
+    FILE *fp = fopen(manifest, "r");
+    if (fp == NULL) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to open manifest for %s", archive_name);
+        perror(err_msg);
+        return -1;
+    }
+    char line[MAX_MSG_LEN];
+    int num_shards;
+    if (fgets(line, sizeof(line), fp) == NULL ||
+        strncmp(line, MANIFEST_MAGIC "\n", sizeof(MANIFEST_MAGIC)) != 0 ||
+        fscanf(fp, "shards %d\n", &num_shards) != 1 || num_shards < 1) {
+        fclose(fp);
+        fprintf(stderr, "Invalid manifest for %s\n", archive_name);
+        return -1;
+    }
+    int capacity = 64;
+    *shards = malloc(capacity * sizeof(int));
+    if (*shards == NULL) {
+        num_shards = -1;
+    }
+    while (num_shards != -1 && fgets(line, sizeof(line), fp) != NULL) {
+        int shard;
+        char name[MAX_NAME_LEN];
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "%d %31[^\n]", &shard, name) != 2 || shard < 0 || shard >= num_shards) {
+            fprintf(stderr, "Invalid manifest entry for %s: %s\n", archive_name, line);
+            num_shards = -1;
+            break;
+        }
+        if (names->size == capacity) {
+            capacity *= 2;
+            int *grown = realloc(*shards, capacity * sizeof(int));
+            if (grown == NULL) {
+                num_shards = -1;
+                break;
+            }
+            *shards = grown;
+        }
+        if (file_list_add(names, name) != 0) {
+            num_shards = -1;
+            break;
+        }
+        (*shards)[names->size - 1] = shard;
+    }
+    fclose(fp);
+    if (num_shards == -1) {
+        perror("Failed to read manifest");
+        free(*shards);
+        *shards = NULL;
+    }
+    return num_shards;
+}
+
+static int get_sharded_archive_file_list(const char *archive_name, file_list_t *files) {
+    file_list_t names;
+    file_list_init(&names);
+    int *shards = NULL;
+    int num_shards = read_manifest(archive_name, &names, &shards);
+    if (num_shards == -1) {
+        file_list_clear(&names);
+        return -1;
+    }
+    shard_task_t *tasks = make_shard_tasks(archive_name, num_shards);
+    if (tasks == NULL || run_shard_tasks(tasks, num_shards, list_shard) != 0) {
+        if (tasks != NULL) {
+            free_shard_tasks(tasks, num_shards);
+        }
+        free(shards);
+        file_list_clear(&names);
+        return -1;
+    }
+    // merge the shards' listings back into the order given by the manifest,
+    // checking each shard actually holds what the manifest says it does
+    node_t **next = malloc(num_shards * sizeof(node_t *));
+    int result = next == NULL ? -1 : 0;
+    for (int k = 0; result == 0 && k < num_shards; k++) {
+        next[k] = tasks[k].files.head;
+    }
+    node_t *name = names.head;
+    for (int i = 0; result == 0 && name != NULL; i++, name = name->next) {
+        node_t *member = next[shards[i]];
+        if (member == NULL || strcmp(member->name, name->name) != 0) {
+            fprintf(stderr, "Shard %d of %s does not match its manifest\n", shards[i],
+                    archive_name);
+            result = -1;
+        } else if (file_list_add(files, member->name) != 0) {
+            perror("Failed to add file to the file list");
+            result = -1;
+        } else {
+            next[shards[i]] = member->next;
+        }
+    }
+    free(next);
+    free_shard_tasks(tasks, num_shards);
+    free(shards);
+    file_list_clear(&names);
+    return result;
+}
+
+static int extract_sharded_archive(const char *archive_name) {
+    file_list_t names;
+    file_list_init(&names);
+    int *shards = NULL;
+    int num_shards = read_manifest(archive_name, &names, &shards);
+    file_list_clear(&names);
+    free(shards);
+    if (num_shards == -1) {
+        return -1;
+    }
+    // all versions of a file live in the same shard, so shards never write the same file
+    shard_task_t *tasks = make_shard_tasks(archive_name, num_shards);
+    if (tasks == NULL) {
+        return -1;
+    }
+    int result = run_shard_tasks(tasks, num_shards, extract_shard);
+    free_shard_tasks(tasks, num_shards);
+    return result;
+}
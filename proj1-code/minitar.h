@@ -2,6 +2,9 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 #ifndef _MINITAR_H
 #define _MINITAR_H
+#include <sys/stat.h>
+#include <sys/types.h>
+
 #include "file_list.h"
 
 // Standard tar header layout defined by POSIX
@@ -79,6 +82,137 @@ int get_archive_file_list(const char *archive_name, file_list_t *files);
  */
 int extract_files_from_archive(const char *archive_name);
 
+/*
+ * Write the contents of the most recently added version of each file named in
+ * 'files' from the archive identified by 'archive_name' to stdout, in the
+ * order given. If 'files' is empty, the latest version of every file in the
+ * archive is written, in archive order. Contents are moved from the archive to
+ * stdout inside the kernel, without being copied through this process.
+ * This function should return 0 upon success or -1 if an error occurred,
+ * including if any requested file is not in the archive.
+ */
+int extract_files_to_stdout(const char *archive_name, const file_list_t *files);
+
 int update_archive(const char *archive_name, file_list_t *files);
 
+/*
+ * Create an incremental backup of the files in 'files' in a new archive named
+ * 'archive_name', using the snapshot file 'snapshot_name' (as with GNU tar's
+ * --listed-incremental). The snapshot records the device, inode, size and
+ * modification time of every file in the previous backup. Only files that are
+ * new or whose recorded state has changed are archived. Files recorded in the
+ * snapshot but no longer in 'files' get a deletion record, which removes the
+ * file when the archive is extracted. If the snapshot does not exist, every
+ * file is archived. The snapshot is updated once the archive is complete.
+ * This function should return 0 upon success or -1 if an error occurred.
+ */
+int create_incremental_archive(const char *archive_name, const file_list_t *files,
+                               const char *snapshot_name);
+
+/*
+ * Append the members of each archive in 'sources', in order, to the archive
+ * 'archive_name', followed by a single new footer. Member headers and contents
+ * are copied as they are, with copy_file_range(2), rather than rebuilt from
+ * the original files. If 'dedupe' is nonzero, only the latest version of each
+ * member name across all of the sources is copied; members already in
+ * 'archive_name' are left in place, but are superseded by later versions.
+ * The new members become visible to readers all at once.
+ * This function should return 0 upon success or -1 if an error occurred.
+ */
+int concatenate_archives(const char *archive_name, const file_list_t *sources, int dedupe);
+
+/*
+ * Create a sharded archive: the files in 'files' are partitioned into
+ * independent, individually valid tar files named "ARCHIVE.0", "ARCHIVE.1", ...
+ * which are written concurrently. All versions of the same file name are kept
+ * together in one shard. If 'volume_size' is 0, files are balanced by size
+ * across 'num_shards' shards. Otherwise each shard is a volume of at most
+ * 'volume_size' bytes, filled first-fit, and as many are used as needed; it is
+ * an error for the versions of one file not to fit in a single volume.
+ * A manifest named "ARCHIVE.manifest" records which shard holds each file.
+ * Any existing non-sharded archive named 'archive_name' is removed, as are
+ * shards beyond the new number of shards that its old manifest listed.
+ * This function should return 0 upon success or -1 if an error occurred.
+ */
+int create_sharded_archive(const char *archive_name, const file_list_t *files, int num_shards,
+                           off_t volume_size);
+
+/*
+ * Returns 1 if 'archive_name' refers to a sharded archive, that is, there is
+ * no archive of that name but there is a manifest for it, and 0 otherwise.
+ * get_archive_file_list() and extract_files_from_archive() handle sharded
+ * archives transparently, working on all of their shards in parallel.
+ */
+int is_sharded_archive(const char *archive_name);
+
+// Location and metadata of a single member within an archive
+typedef struct {
+    // Copy of the member's header block
+    tar_header header;
+    // Byte offset of the member's header block within the archive
+    off_t offset;
+    // Size of the member's contents in bytes
+    size_t size;
+} archive_member_t;
+
+// In-memory index of an archive's members, in the order they appear
+typedef struct {
+    archive_member_t *members;
+    int size;
+    int capacity;
+    // Byte offset of the archive's end-of-archive marker
+    off_t end;
+} archive_index_t;
+
+// Initialize a new, empty archive index
+void archive_index_init(archive_index_t *index);
+
+/*
+ * Scan the headers of the archive identified by 'archive_name' and record the
+ * location of each member in 'index'. Member contents are skipped, not read.
+ * This function should return 0 upon success or -1 if an error occurred.
+ */
+int archive_index_load(const char *archive_name, archive_index_t *index);
+
+// Free any memory associated with an archive index
+void archive_index_clear(archive_index_t *index);
+
+/*
+ * Bring 'index' up to date with the archive open as 'fd'. If the members it
+ * already holds are still present, only members added after them are scanned;
+ * otherwise the archive is indexed from scratch. If 'max_members' is positive,
+ * at most that many members are added, so a large archive can be indexed a
+ * piece at a time; the members already indexed then stay valid.
+ * This function should return 0 upon success, 1 if there may be more members
+ * left to index, or -1 if an error occurred.
+ */
+int archive_index_refresh(int fd, archive_index_t *index, int max_members);
+
+/*
+ * Hand 'index', describing the version of an archive with metadata 'stat_buf',
+ * to the next operation in this process that reads that same version of the
+ * archive, which then skips scanning its headers. Ownership of the index's
+ * memory moves with it and 'index' is left empty.
+ * Used by the server to pass its warm indexes to the process handling a request.
+ */
+void archive_index_preload(archive_index_t *index, const struct stat *stat_buf);
+
+/*
+ * Look up the user and group names for 'uid' and 'gid' ahead of time, so that
+ * headers for files they own are later filled without consulting the system
+ * user and group databases.
+ */
+void prime_name_cache(uid_t uid, gid_t gid);
+
+/*
+ * Compare each member of the archive identified by 'archive_name' against the
+ * file of the same name in the current working directory, without modifying
+ * either. Members are checked in parallel. Only the most recently added version
+ * of a file is compared, since that is the version extraction would produce.
+ * Each mismatch is reported on stdout as "NAME: <what> differs".
+ * This function should return 0 if everything matched, 1 if any difference was
+ * found, or -1 if an error occurred.
+ */
+int verify_archive(const char *archive_name);
+
 #endif    // _MINITAR_H
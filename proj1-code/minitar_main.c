@@ -1,12 +1,49 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "file_list.h"
 #include "minitar.h"
+#include "minitar_server.h"
 
-int main(int argc, char **argv) {
+/*
+ * Parse a byte count such as "4096", "512K", "100M" or "2G" into 'size'
+ * Returns 0 on success or -1 if 'str' is not a valid, positive size
+ */
+static int parse_size(const char *str, off_t *size) {
+    char *end;
+    long long value = strtoll(str, &end, 10);
+    switch (*end) {
+        case 'G':
+        case 'g':
+            value *= 1024;
+            // fall through
+        case 'M':
+        case 'm':
+            value *= 1024;
+            // fall through
+        case 'K':
+        case 'k':
+            value *= 1024;
+            end++;
+            break;
+    }
+    if (end == str || *end != '\0' || value <= 0) {
+        return -1;
+    }
+    *size = value;
+    return 0;
+}
+
+// Parse a minitar command line and run the operation it names
+static int run_command(int argc, char **argv) {
     if (argc < 4) {
-        printf("Usage: %s -c|a|t|u|x -f ARCHIVE [FILE...]\n", argv[0]);
+        printf("Usage: %s -c|a|t|u|x|d [--shards N|--volume-size SIZE] [-g SNAPSHOT] [-O] "
+               "-f ARCHIVE [FILE...]\n",
+               argv[0]);
+        printf("       %s -A [--dedupe] -f ARCHIVE SOURCE_ARCHIVE...\n", argv[0]);
+        printf("       %s --server SOCKET\n", argv[0]);
+        printf("Set %s=SOCKET to run commands through a server\n", SERVER_SOCKET_ENV);
         return 0;
     }
 
@@ -21,22 +58,65 @@ int main(int argc, char **argv) {
         perror("Improper command line arguments");
         return 1;
     }
+    // long forms of the verify and concatenate operations
+    if (strcmp(argv[1], "--verify") == 0) {
+        operation = 'd';
+    } else if (strcmp(argv[1], "--concatenate") == 0) {
+        operation = 'A';
+    }
+    // optional settings come between the operation and "-f"
+    int num_shards = 0;
+    off_t volume_size = 0;
+    int to_stdout = 0;
+    int dedupe = 0;
+    const char *snapshot_name = NULL;
+    int arg = 2;
+    for (; arg < argc && strcmp(argv[arg], "-f") != 0; arg++) {
+        if (strcmp(argv[arg], "--shards") == 0 && arg + 1 < argc) {
+            num_shards = atoi(argv[++arg]);
+            if (num_shards < 1) {
+                printf("Error: Number of shards must be at least 1\n");
+                return 1;
+            }
+        } else if (strcmp(argv[arg], "--volume-size") == 0 && arg + 1 < argc) {
+            if (parse_size(argv[++arg], &volume_size) != 0) {
+                printf("Error: Invalid volume size %s\n", argv[arg]);
+                return 1;
+            }
+        } else if ((strcmp(argv[arg], "-g") == 0 ||
+                    strcmp(argv[arg], "--listed-incremental") == 0) && arg + 1 < argc) {
+            snapshot_name = argv[++arg];
+        } else if (strcmp(argv[arg], "-O") == 0 || strcmp(argv[arg], "--to-stdout") == 0) {
+            to_stdout = 1;
+        } else if (strcmp(argv[arg], "--dedupe") == 0) {
+            dedupe = 1;
+        } else {
+            perror("Improper command line arguments");
+            return 1;
+        }
+    }
     // make sure "-f" flag is there
-    if (strcmp(argv[2], "-f") != 0) {
+    if (arg + 1 >= argc) {
         perror("Improper command line arguments");
         return 1;
     }
 
-    char *archiveName = argv[3];
+    char *archiveName = argv[arg + 1];
 
-    for (int i = 4; i < argc; i++) {
+    for (int i = arg + 2; i < argc; i++) {
         file_list_add(&files, argv[i]);
     }
 
     int result = 0;
     switch(operation) {
         case 'c':
-            result = create_archive(archiveName, &files);
+            if (snapshot_name != NULL) {
+                result = create_incremental_archive(archiveName, &files, snapshot_name);
+            } else if (num_shards > 0 || volume_size > 0) {
+                result = create_sharded_archive(archiveName, &files, num_shards, volume_size);
+            } else {
+                result = create_archive(archiveName, &files);
+            }
             if (result != 0) {
                 perror("Failed to create archive");
             }
@@ -63,7 +143,26 @@ int main(int argc, char **argv) {
             result = update_archive(archiveName, &files);
             break;
         case 'x':
-            //result = minitar_extract(archiveName);
+            if (to_stdout) {
+                result = extract_files_to_stdout(archiveName, &files);
+            } else {
+                result = extract_files_from_archive(archiveName);
+            }
+            if (result != 0) {
+                perror("Failed to extract files from archive");
+            }
+            break;
+        case 'A':
+            result = concatenate_archives(archiveName, &files, dedupe);
+            if (result != 0) {
+                perror("Failed to concatenate archives");
+            }
+            break;
+        case 'd':
+            result = verify_archive(archiveName);
+            if (result == -1) {
+                perror("Failed to verify archive");
+            }
             break;
         default:
             perror("Improper command line arguments");
@@ -74,3 +173,16 @@ int main(int argc, char **argv) {
     file_list_clear(&files);
     return result;
 }
+
+int main(int argc, char **argv) {
+    if (argc == 3 && strcmp(argv[1], "--server") == 0) {
+        return run_server(argv[2], run_command);
+    }
+    // hand the command to a running server if there is one, otherwise run it here
+    const char *socket_path = getenv(SERVER_SOCKET_ENV);
+    int result;
+    if (socket_path != NULL && run_client(socket_path, argc, argv, &result) == 0) {
+        return result;
+    }
+    return run_command(argc, argv);
+}
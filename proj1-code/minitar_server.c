@@ -0,0 +1,546 @@
+#define _GNU_SOURCE
+
+#include "minitar_server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "minitar.h"
+
+#define MAX_MSG_LEN 128
+// Identifies a minitar request ("mtar")
+#define REQUEST_MAGIC 0x6d746172
+// Limits on the size of a request's command line
+#define MAX_REQUEST_ARGS 65536
+#define MAX_REQUEST_LEN (16 * 1024 * 1024)
+// Descriptors passed with each request: working directory, stdin, stdout, stderr
+#define NUM_PASSED_FDS 4
+// Number of archives whose indexes the server keeps in memory
+#define MAX_CACHED_ARCHIVES 64
+// Most members the server indexes between checks for waiting connections
+#define REFRESH_BATCH_MEMBERS 256
+
+// Fixed-size start of each request, followed by 'args_len' bytes holding the
+// 'argc' null-terminated arguments back to back
+typedef struct {
+    uint32_t magic;
+    uint32_t argc;
+    uint32_t args_len;
+    // File mode creation mask of the client, for the files the command creates
+    uint32_t umask;
+} request_header_t;
+
+// Header index of an archive the server has seen
+typedef struct {
+    struct stat stat_buf;
+    archive_index_t index;
+    // Value of 'num_requests' when this entry was last used
+    unsigned long last_used;
+    int in_use;
+    // Set while the server is still bringing 'index' up to date, a batch of
+    // members at a time, from the archive open as 'refresh_fd'
+    int refresh_pending;
+    int refresh_fd;
+} cached_archive_t;
+
+static cached_archive_t cached_archives[MAX_CACHED_ARCHIVES];
+static unsigned long num_requests = 0;
+// Number of cache entries with 'refresh_pending' set
+static int num_pending_refreshes = 0;
+
+// Read exactly 'len' bytes from 'fd'
+// Returns 0 on success or -1 if an error occurs or the peer hangs up
+static int read_all(int fd, void *buf, size_t len) {
+    char *pos = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, pos, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        pos += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Write exactly 'len' bytes to 'fd'
+// Returns 0 on success or -1 if an error occurs
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *pos = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, pos, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        pos += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Fill 'addr' with the address of the socket at 'socket_path'
+// Returns 0 on success or -1 if the path is too long
+static int make_address(struct sockaddr_un *addr, const char *socket_path) {
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, socket_path);
+    return 0;
+}
+
+int run_client(const char *socket_path, int argc, char **argv, int *result) {
+    struct sockaddr_un addr;
+    if (make_address(&addr, socket_path) != 0) {
+        return -1;
+    }
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1) {
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        close(sock);
+        return -1;
+    }
+    int cwd = open(".", O_RDONLY | O_DIRECTORY);
+    if (cwd == -1) {
+        close(sock);
+        return -1;
+    }
+
+    // lay the arguments out back to back, each with its null terminator
+    // umask() can only be read by setting it, so put it straight back
+    mode_t mask = umask(0);
+    umask(mask);
+    request_header_t header = {REQUEST_MAGIC, argc, 0, mask};
+    for (int i = 0; i < argc; i++) {
+        header.args_len += strlen(argv[i]) + 1;
+    }
+    char *args = malloc(header.args_len);
+    if (args == NULL) {
+        close(cwd);
+        close(sock);
+        return -1;
+    }
+    char *pos = args;
+    for (int i = 0; i < argc; i++) {
+        size_t len = strlen(argv[i]) + 1;
+        memcpy(pos, argv[i], len);
+        pos += len;
+    }
+
+    // the descriptors travel alongside the header as ancillary data
+    int fds[NUM_PASSED_FDS] = {cwd, STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {&header, sizeof(header)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    int sent = sendmsg(sock, &msg, 0) == sizeof(header) &&
+               write_all(sock, args, header.args_len) == 0;
+    free(args);
+    close(cwd);
+    if (!sent) {
+        close(sock);
+        return -1;
+    }
+    // the server replies with the command's exit status once it has finished
+    int32_t status;
+    if (read_all(sock, &status, sizeof(status)) != 0) {
+        fprintf(stderr, "minitar server at %s did not complete the request\n", socket_path);
+        status = 1;
+    }
+    close(sock);
+    *result = status;
+    return 0;
+}
+
+/*
+ * Receive a request header and the descriptors sent with it from 'conn'.
+ * Returns 0 on success or -1 if the request is malformed
+ */
+static int receive_request_header(int conn, request_header_t *header, int fds[NUM_PASSED_FDS]) {
+    char control[CMSG_SPACE(sizeof(int) * NUM_PASSED_FDS)];
+    struct iovec iov = {header, sizeof(request_header_t)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    if (n <= 0) {
+        return -1;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+    if (cmsg->cmsg_len != CMSG_LEN(sizeof(int) * NUM_PASSED_FDS)) {
+        // don't leak whatever descriptors did arrive
+        int num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < num_fds; i++) {
+            close(((int *) CMSG_DATA(cmsg))[i]);
+        }
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * NUM_PASSED_FDS);
+    // the rest of a header split across reads carries no further descriptors
+    if (n < sizeof(request_header_t) &&
+        read_all(conn, (char *) header + n, sizeof(request_header_t) - n) != 0) {
+        n = -1;
+    }
+    if (n == -1 || header->magic != REQUEST_MAGIC || header->argc == 0 ||
+        header->argc > MAX_REQUEST_ARGS || header->args_len > MAX_REQUEST_LEN) {
+        for (int i = 0; i < NUM_PASSED_FDS; i++) {
+            close(fds[i]);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+// Returns the archive named by the "-f" option of a command line, or NULL
+static const char *find_archive_name(int argc, char **argv) {
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "-f") == 0) {
+            return argv[i + 1];
+        }
+    }
+    return NULL;
+}
+
+// Stop the refresh pending for 'entry', if any
+static void cancel_refresh(cached_archive_t *entry) {
+    if (entry->refresh_pending) {
+        close(entry->refresh_fd);
+        entry->refresh_pending = 0;
+        num_pending_refreshes--;
+    }
+}
+
+// Returns the cache entry of the archive with metadata 'stat_buf', taking over
+// the least recently used entry for it if it has none
+static cached_archive_t *find_cached_archive(const struct stat *stat_buf) {
+    cached_archive_t *victim = &cached_archives[0];
+    for (int i = 0; i < MAX_CACHED_ARCHIVES; i++) {
+        cached_archive_t *entry = &cached_archives[i];
+        if (entry->in_use && entry->stat_buf.st_dev == stat_buf->st_dev &&
+            entry->stat_buf.st_ino == stat_buf->st_ino) {
+            return entry;
+        }
+        if (!entry->in_use || (victim->in_use && entry->last_used < victim->last_used)) {
+            victim = entry;
+        }
+    }
+    if (victim->in_use) {
+        cancel_refresh(victim);
+        archive_index_clear(&victim->index);
+    }
+    archive_index_init(&victim->index);
+    victim->stat_buf = *stat_buf;
+    victim->in_use = 1;
+    return victim;
+}
+
+/*
+ * Bring the cached index of the archive open as 'fd' up to date, adding it to
+ * the cache if needed.
+ * Returns the cache entry, or NULL if no up-to-date index is available, in
+ * which case the request simply indexes the archive itself.
+ */
+static cached_archive_t *refresh_cached_archive(int fd) {
+    // no lock is needed: an append in progress is simply not indexed yet, and
+    // the stat taken first makes the request rescan once it has been published
+    struct stat stat_buf;
+    if (fstat(fd, &stat_buf) != 0 || !S_ISREG(stat_buf.st_mode)) {
+        return NULL;
+    }
+    cached_archive_t *cached = find_cached_archive(&stat_buf);
+    if (archive_index_refresh(fd, &cached->index, 0) != 0) {
+        cached->in_use = 0;
+        return NULL;
+    }
+    cached->stat_buf = stat_buf;
+    cached->last_used = num_requests;
+    return cached;
+}
+
+/*
+ * Pass a descriptor for the archive 'archive_name' to the server over
+ * 'notify', so the server can bring its own cached index up to date once it
+ * has no connections waiting. The notification is dropped if the server is
+ * behind on them; it only makes a later request scan a little more.
+ */
+static void notify_archive_changed(int notify, const char *archive_name) {
+    int fd = open(archive_name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    char byte = 0;
+    struct iovec iov = {&byte, sizeof(byte)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    sendmsg(notify, &msg, MSG_DONTWAIT);
+    close(fd);
+}
+
+/*
+ * Server side of a notification sent by notify_archive_changed(): receive the
+ * archive descriptor from 'notify' and queue a refresh of its cached index.
+ */
+static void handle_archive_notification(int notify) {
+    char control[CMSG_SPACE(sizeof(int))];
+    char byte;
+    struct iovec iov = {&byte, sizeof(byte)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(notify, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC) <= 0) {
+        return;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+        return;
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    struct stat stat_buf;
+    if (fstat(fd, &stat_buf) != 0 || !S_ISREG(stat_buf.st_mode)) {
+        close(fd);
+        return;
+    }
+    // the indexing itself is done by continue_refresh(), a batch at a time
+    cached_archive_t *cached = find_cached_archive(&stat_buf);
+    cancel_refresh(cached);
+    cached->refresh_fd = fd;
+    cached->refresh_pending = 1;
+    cached->last_used = num_requests;
+    num_pending_refreshes++;
+}
+
+// Index the next batch of members of an archive whose cached index is being
+// brought up to date, so no refresh holds up the accept loop for long
+static void continue_refresh(void) {
+    for (int i = 0; i < MAX_CACHED_ARCHIVES; i++) {
+        cached_archive_t *entry = &cached_archives[i];
+        if (entry->refresh_pending) {
+            int result =
+                archive_index_refresh(entry->refresh_fd, &entry->index, REFRESH_BATCH_MEMBERS);
+            if (result != 1) {
+                cancel_refresh(entry);
+            }
+            if (result == -1) {
+                entry->in_use = 0;
+            }
+            return;
+        }
+    }
+}
+
+/*
+ * Child process side of a request: read the request from 'conn', switch to the
+ * client's working directory and standard streams, run the command, and report
+ * its status on 'conn'. Everything that may block or scan an archive happens
+ * here rather than in the server's accept loop.
+ */
+static void run_request(int conn, int notify, command_handler_t handler) {
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    // commands run with the server's privileges, so only serve its own user
+    struct ucred peer;
+    socklen_t peer_len = sizeof(peer);
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &peer, &peer_len) != 0 ||
+        peer.uid != getuid()) {
+        _exit(1);
+    }
+    request_header_t header;
+    int fds[NUM_PASSED_FDS];
+    if (receive_request_header(conn, &header, fds) != 0) {
+        _exit(1);
+    }
+    char *args = malloc(header.args_len + 1);
+    char **argv = malloc((header.argc + 1) * sizeof(char *));
+    if (args == NULL || argv == NULL || read_all(conn, args, header.args_len) != 0) {
+        _exit(1);
+    }
+    // split the null-terminated arguments back apart
+    int argc = 0;
+    args[header.args_len] = '\0';
+    for (char *pos = args; pos < args + header.args_len && argc < header.argc;
+         pos += strlen(pos) + 1) {
+        argv[argc++] = pos;
+    }
+    argv[argc] = NULL;
+    if (argc != header.argc) {
+        _exit(1);
+    }
+
+    if (fchdir(fds[0]) != 0 || dup2(fds[1], STDIN_FILENO) == -1 ||
+        dup2(fds[2], STDOUT_FILENO) == -1 || dup2(fds[3], STDERR_FILENO) == -1) {
+        _exit(1);
+    }
+    umask(header.umask & 0777);
+    for (int i = 0; i < NUM_PASSED_FDS; i++) {
+        close(fds[i]);
+    }
+    // the index inherited from the server only needs the members added since
+    const char *archive_name = find_archive_name(argc, argv);
+    int fd = archive_name == NULL ? -1 : open(archive_name, O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        cached_archive_t *cached = refresh_cached_archive(fd);
+        if (cached != NULL) {
+            archive_index_preload(&cached->index, &cached->stat_buf);
+        }
+        close(fd);
+    }
+    int32_t status = handler(argc, argv);
+    fflush(stdout);
+    fflush(stderr);
+    write_all(conn, &status, sizeof(status));
+    if (archive_name != NULL) {
+        notify_archive_changed(notify, archive_name);
+    }
+    _exit(0);
+}
+
+// Start a child process to read and run the request on 'conn'
+static void serve_request(int listener, int notify[2], int conn, command_handler_t handler) {
+    num_requests++;
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(listener);
+        close(notify[0]);
+        for (int i = 0; i < MAX_CACHED_ARCHIVES; i++) {
+            if (cached_archives[i].refresh_pending) {
+                close(cached_archives[i].refresh_fd);
+            }
+        }
+        run_request(conn, notify[1], handler);
+    } else if (pid == -1) {
+        perror("Failed to start process for request");
+    }
+}
+
+int run_server(const char *socket_path, command_handler_t handler) {
+    char err_msg[MAX_MSG_LEN];
+    struct sockaddr_un addr;
+    if (make_address(&addr, socket_path) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Invalid socket path %s", socket_path);
+        perror(err_msg);
+        return -1;
+    }
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener == -1) {
+        perror("Failed to create server socket");
+        return -1;
+    }
+    // replace the socket left behind by a previous server, but nothing else
+    struct stat stat_buf;
+    if (lstat(socket_path, &stat_buf) == 0) {
+        if (!S_ISSOCK(stat_buf.st_mode)) {
+            fprintf(stderr, "Refusing to replace %s, which is not a socket\n", socket_path);
+            close(listener);
+            return -1;
+        }
+        unlink(socket_path);
+    }
+    // children pass back the archives they used, to refresh the cached indexes
+    int notify[2];
+    if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, notify) != 0) {
+        perror("Failed to create server socket");
+        close(listener);
+        return -1;
+    }
+    // only the server's own user may connect, whatever the umask
+    mode_t old_mask = umask(0177);
+    int bound = bind(listener, (struct sockaddr *) &addr, sizeof(addr)) == 0;
+    umask(old_mask);
+    if (!bound || listen(listener, SOMAXCONN) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to listen on %s", socket_path);
+        perror(err_msg);
+        close(notify[0]);
+        close(notify[1]);
+        close(listener);
+        return -1;
+    }
+    // children are reaped automatically, and a vanished client must not kill the server
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+    // do the slow first user and group lookups once, up front; only the
+    // server's own ids stay warm, as children's lookups die with them
+    prime_name_cache(getuid(), getgid());
+
+    struct pollfd pollfds[2] = {{listener, POLLIN, 0}, {notify[0], POLLIN, 0}};
+    while (1) {
+        // while indexes are being refreshed, only check for connections
+        if (poll(pollfds, 2, num_pending_refreshes > 0 ? 0 : -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Failed to wait for connections");
+            break;
+        }
+        // refresh cached indexes only while no connection is waiting
+        if (!(pollfds[0].revents & POLLIN)) {
+            if (pollfds[1].revents & POLLIN) {
+                handle_archive_notification(notify[0]);
+            }
+            continue_refresh();
+            continue;
+        }
+        int conn = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (conn == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("Failed to accept connection");
+            break;
+        }
+        serve_request(listener, notify, conn, handler);
+        close(conn);
+    }
+    close(notify[0]);
+    close(notify[1]);
+    close(listener);
+    return -1;
+}
@@ -0,0 +1,42 @@
+#ifndef _MINITAR_SERVER_H
+#define _MINITAR_SERVER_H
+
+// Environment variable holding the socket path of a running minitar server.
+// When it is set, minitar forwards its command line to that server.
+#define SERVER_SOCKET_ENV "MINITAR_SOCKET"
+
+// Runs a single minitar command line, returning its exit status
+typedef int (*command_handler_t)(int argc, char **argv);
+
+/*
+ * Listen on a Unix domain socket at 'socket_path' and serve minitar command
+ * lines sent by clients. Each request is run by 'handler' in its own child
+ * process, in the client's working directory and with the client's standard
+ * streams and umask, so requests proceed concurrently; the children read the
+ * requests themselves, so a slow client never holds up the others. The server
+ * keeps the header index of each archive it has seen and hands it to the
+ * children, so it need not be rebuilt for every request. Children pass back
+ * the archives they used, and the server brings its indexes up to date a
+ * batch of members at a time whenever no connection is waiting. The user and
+ * group names of the server's own ids are looked up once, up front; names
+ * children look up for other ids are not passed back, so those are looked up
+ * again by each request.
+ * Concurrent writes to the same archive are serialized by the archive locks
+ * taken in minitar.c; reads take no locks and run alongside them.
+ * Only the user running the server may connect to the socket, which is
+ * created with mode 0600. An existing file at 'socket_path' is only replaced
+ * if it is a socket.
+ * This function only returns if an error occurred, returning -1.
+ */
+int run_server(const char *socket_path, command_handler_t handler);
+
+/*
+ * Send the command line 'argc'/'argv' to the server listening at 'socket_path'
+ * along with this process's working directory and standard streams, wait for
+ * the server to run it, and store the command's exit status in 'result'.
+ * This function should return 0 if the server ran the command, or -1 if no
+ * server could be reached, in which case the command has not been run.
+ */
+int run_client(const char *socket_path, int argc, char **argv, int *result);
+
+#endif    // _MINITAR_SERVER_H
@@ -0,0 +1,178 @@
+#include "snapshot.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Identifies a snapshot file and the version of its layout
+#define SNAPSHOT_MAGIC "MTSNAP01"
+#define SNAPSHOT_MAGIC_LEN 8
+
+// Fixed-size start of a snapshot file, followed by 'num_entries' entries
+typedef struct {
+    char magic[SNAPSHOT_MAGIC_LEN];
+    uint64_t num_entries;
+} snapshot_file_header_t;
+
+void snapshot_init(snapshot_t *snapshot) {
+    snapshot->entries = NULL;
+    snapshot->size = 0;
+    snapshot->capacity = 0;
+    snapshot->buckets = NULL;
+    snapshot->num_buckets = 0;
+}
+
+void snapshot_clear(snapshot_t *snapshot) {
+    free(snapshot->entries);
+    free(snapshot->buckets);
+    snapshot_init(snapshot);
+}
+
+// FNV-1a hash of a file name
+static uint32_t hash_name(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < MAX_NAME_LEN && name[i] != '\0'; i++) {
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Returns the bucket holding 'name', or the empty bucket where it would go
+static int find_bucket(const snapshot_t *snapshot, const char *name) {
+    int mask = snapshot->num_buckets - 1;
+    int bucket = hash_name(name) & mask;
+    while (snapshot->buckets[bucket] != -1 &&
+           strncmp(snapshot->entries[snapshot->buckets[bucket]].name, name, MAX_NAME_LEN) != 0) {
+        bucket = (bucket + 1) & mask;
+    }
+    return bucket;
+}
+
+// Make room for at least one more entry, keeping the table at most half full
+// Returns 0 on success or -1 if an error occurs
+static int snapshot_grow(snapshot_t *snapshot) {
+    if (snapshot->size == snapshot->capacity) {
+        int new_capacity = snapshot->capacity == 0 ? 64 : snapshot->capacity * 2;
+        snapshot_entry_t *entries =
+            realloc(snapshot->entries, new_capacity * sizeof(snapshot_entry_t));
+        if (entries == NULL) {
+            return -1;
+        }
+        snapshot->entries = entries;
+        snapshot->capacity = new_capacity;
+    }
+    if (2 * (snapshot->size + 1) > snapshot->num_buckets) {
+        int num_buckets = snapshot->num_buckets == 0 ? 128 : snapshot->num_buckets * 2;
+        int *buckets = malloc(num_buckets * sizeof(int));
+        if (buckets == NULL) {
+            return -1;
+        }
+        free(snapshot->buckets);
+        snapshot->buckets = buckets;
+        snapshot->num_buckets = num_buckets;
+        memset(buckets, -1, num_buckets * sizeof(int));
+        for (int i = 0; i < snapshot->size; i++) {
+            buckets[find_bucket(snapshot, snapshot->entries[i].name)] = i;
+        }
+    }
+    return 0;
+}
+
+// Add 'entry' to 'snapshot', replacing any existing entry of the same name
+// Returns 0 on success or -1 if an error occurs
+static int snapshot_insert(snapshot_t *snapshot, const snapshot_entry_t *entry) {
+    if (snapshot_grow(snapshot) != 0) {
+        return -1;
+    }
+    int bucket = find_bucket(snapshot, entry->name);
+    if (snapshot->buckets[bucket] == -1) {
+        snapshot->buckets[bucket] = snapshot->size++;
+    }
+    snapshot->entries[snapshot->buckets[bucket]] = *entry;
+    return 0;
+}
+
+int snapshot_add(snapshot_t *snapshot, const char *name, const struct stat *stat_buf) {
+    snapshot_entry_t entry;
+    memset(&entry, 0, sizeof(entry));
+    strncpy(entry.name, name, MAX_NAME_LEN - 1);
+    entry.dev = stat_buf->st_dev;
+    entry.ino = stat_buf->st_ino;
+    entry.size = stat_buf->st_size;
+    entry.mtime_sec = stat_buf->st_mtim.tv_sec;
+    entry.mtime_nsec = stat_buf->st_mtim.tv_nsec;
+    return snapshot_insert(snapshot, &entry);
+}
+
+const snapshot_entry_t *snapshot_find(const snapshot_t *snapshot, const char *name) {
+    if (snapshot->size == 0) {
+        return NULL;
+    }
+    int i = snapshot->buckets[find_bucket(snapshot, name)];
+    return i == -1 ? NULL : &snapshot->entries[i];
+}
+
+int snapshot_entry_matches(const snapshot_entry_t *entry, const struct stat *stat_buf) {
+    return entry->dev == stat_buf->st_dev && entry->ino == stat_buf->st_ino &&
+           entry->size == stat_buf->st_size && entry->mtime_sec == stat_buf->st_mtim.tv_sec &&
+           entry->mtime_nsec == stat_buf->st_mtim.tv_nsec;
+}
+
+int snapshot_load(snapshot_t *snapshot, const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    snapshot_file_header_t header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        memcmp(header.magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) != 0 ||
+        header.num_entries > INT_MAX / 2) {
+        fprintf(stderr, "%s is not a valid snapshot file\n", path);
+        fclose(fp);
+        return -1;
+    }
+    snapshot_entry_t entry;
+    for (uint64_t i = 0; i < header.num_entries; i++) {
+        if (fread(&entry, sizeof(entry), 1, fp) != 1) {
+            fprintf(stderr, "Snapshot file %s is truncated\n", path);
+            fclose(fp);
+            return -1;
+        }
+        entry.name[MAX_NAME_LEN - 1] = '\0';
+        if (snapshot_insert(snapshot, &entry) != 0) {
+            fclose(fp);
+            return -1;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+int snapshot_save(const snapshot_t *snapshot, const char *path) {
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= sizeof(tmp_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    FILE *fp = fopen(tmp_path, "w");
+    if (fp == NULL) {
+        return -1;
+    }
+    snapshot_file_header_t header;
+    memcpy(header.magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN);
+    header.num_entries = snapshot->size;
+    int ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+             fwrite(snapshot->entries, sizeof(snapshot_entry_t), snapshot->size, fp) ==
+                 snapshot->size;
+    // the contents must be on disk before the rename can replace the old snapshot
+    ok = ok && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    if (fclose(fp) != 0 || !ok || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,54 @@
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "file_list.h"
+
+// State of one file as recorded by an incremental backup
+typedef struct {
+    char name[MAX_NAME_LEN];
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+} snapshot_entry_t;
+
+// Set of file states, with a hash table for looking them up by name
+typedef struct {
+    snapshot_entry_t *entries;
+    int size;
+    int capacity;
+    // Open-addressed table of positions in 'entries', -1 marking an empty slot
+    int *buckets;
+    int num_buckets;
+} snapshot_t;
+
+// Initialize a new, empty snapshot
+void snapshot_init(snapshot_t *snapshot);
+
+// Read the snapshot file 'path' into the empty 'snapshot'
+// A missing file is treated as an empty snapshot, as for a first, full backup
+// Returns 0 on success or -1 if an error occurs
+int snapshot_load(snapshot_t *snapshot, const char *path);
+
+// Write 'snapshot' to the file 'path', replacing it only once fully written and synced
+// Returns 0 on success or -1 if an error occurs
+int snapshot_save(const snapshot_t *snapshot, const char *path);
+
+// Record the state 'stat_buf' of the file 'name' in 'snapshot'
+// Returns 0 on success or -1 if an error occurs
+int snapshot_add(snapshot_t *snapshot, const char *name, const struct stat *stat_buf);
+
+// Returns the entry for 'name' in 'snapshot', or NULL if there is none
+const snapshot_entry_t *snapshot_find(const snapshot_t *snapshot, const char *name);
+
+// Returns 1 if 'stat_buf' describes the same version of a file as 'entry', 0 otherwise
+int snapshot_entry_matches(const snapshot_entry_t *entry, const struct stat *stat_buf);
+
+// Remove all entries from the snapshot and free any memory associated with them
+void snapshot_clear(snapshot_t *snapshot);
+
+#endif    // _SNAPSHOT_H